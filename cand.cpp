@@ -5,59 +5,167 @@ bool larger( const Cand *pl, const Cand *pr )
 	return pl->score > pr->score;
 }
 
+/************************************************************************
+ 1. 函数功能: 回溯得到候选的译文
+ 2. 入口参数: 无
+ 3. 出口参数: 在wids末尾加入当前候选译文的单词id序列
+ 4. 算法简介: 按照规则目标端叶节点的顺序, 终结符直接输出, 非终结符
+              递归输出所用子候选的译文; glue候选顺序输出所有子候选的译文
+ * **********************************************************************/
+void Cand::get_tgt_wids(vector<int> &wids) const
+{
+	if (type == OOV)
+	{
+		wids.push_back(oov_wid);
+	}
+	else if (type == NORMAL)
+	{
+		const TgtRule &applied_rule = matched_rule_group->rules()[rule_rank];
+		size_t nt_idx = 0;
+		for (int i=0; i<applied_rule.leaf_num; i++)
+		{
+			if (applied_rule.aligned_src_positions()[i] == -1)
+			{
+				wids.push_back(applied_rule.tgt_leaves()[i]);
+			}
+			else
+			{
+				(*cands_of_nt_leaves)[nt_idx][cand_rank_vec[nt_idx]]->get_tgt_wids(wids);
+				nt_idx++;
+			}
+		}
+	}
+	else if (type == GLUE)
+	{
+		for (size_t i=0; i<cands_of_nt_leaves->size(); i++)
+		{
+			(*cands_of_nt_leaves)[i][cand_rank_vec[i]]->get_tgt_wids(wids);
+		}
+	}
+}
+
 /************************************************************************
  1. 函数功能: 将翻译候选加入列表中, 并进行假设重组
  2. 入口参数: 翻译候选的指针
  3. 出口参数: 如果候选被丢弃,返回false;否则返回true
- 4. 算法简介: a) 如果当前候选与优先级队列中的某个候选的目标端边界词相同,
-              a.1) 如果当前候选的得分低, 则丢弃当前候选
-              a.2) 如果当前候选的得分低, 则替换原候选
-              a.3) 如果二者得分相同, 则将当前候选加入列表
-              b) 如果当前候选与优先级队列中的所有候选的目标端边界词不同,
+ 4. 算法简介: a) 如果当前候选与已有的某个候选的目标端根节点和译文相同,
+              a.1) 如果当前候选的得分低或二者相同, 则丢弃当前候选
+              a.2) 如果当前候选的得分高, 则替换原候选
+              b) 如果当前候选与所有已有候选的目标端根节点或译文不同,
 	         则将当前候选加入列表
+              通过哈希表只与哈希值相同的候选比较, 每次加入的代价为O(1)
  * **********************************************************************/
 bool CandOrganizer::add(Cand *&cand)
 { 
-	for (auto &e_cand : all_cands)
+	size_t key = get_recombine_key(cand);
+	auto range = key_to_pos.equal_range(key);
+	for (auto it=range.first; it!=range.second; it++)
 	{
-		if ( is_bound_same(cand,e_cand) && cand->tgt_root == e_cand->tgt_root )
+		Cand *&e_cand = all_cands[it->second];
+		if ( cand->tgt_root == e_cand->tgt_root && is_tgt_same(cand,e_cand) )
 		{
 			if (cand->score <= e_cand->score)
 			{
+				cand->next_recombined = e_cand->next_recombined;     // 挂到被保留候选的重组链上
+				e_cand->next_recombined = cand;
 				return false;
 			}
-			if (cand->score > e_cand->score)
-			{
-				recombined_cands.push_back(e_cand);
-				swap(e_cand,cand);
-				return true;
-			}
+			cand->next_recombined = e_cand;                          // 原候选连同它的重组链挂到当前候选上
+			swap(e_cand,cand);
+			return true;
 		}
 	}
+	key_to_pos.insert(make_pair(key,all_cands.size()));
 	all_cands.push_back(cand); 
 	return true;
 }
 
-bool CandOrganizer::is_bound_same(const Cand *a, const Cand *b)
+// 计算候选重组用的哈希值, 与is_tgt_same一致, 即由目标端根节点和完整译文决定
+size_t CandOrganizer::get_recombine_key(const Cand *cand)
 {
-	size_t len_a = a->tgt_wids.size();
-	size_t len_b = b->tgt_wids.size();
-	size_t bound_len_a = min(len_a, LM_ORDER-1);
-	size_t bound_len_b = min(len_b, LM_ORDER-1);
-	if (bound_len_a != bound_len_b)
-		return false;
-	if (bound_len_a < LM_ORDER && a->tgt_wids != b->tgt_wids)
+	return util::MurmurHashNative(&cand->tgt_hash,sizeof(uint64_t),cand->tgt_root);
+}
+
+/************************************************************************
+ 1. 函数功能: 判断两个候选的译文是否完全相同
+ 2. 入口参数: 两个候选
+ 3. 出口参数: 译文相同返回true
+ 4. 算法简介: a) 长度, 哈希值或语言模型状态不同时译文一定不同
+              b) 否则同步地展开两个候选的推导并比较: 两边当前位置是同一个子候选时整体跳过,
+                 否则展开译文较长的一边的候选, 两边都是词时逐词比较; 重组的候选通常共享
+                 大部分子候选, 因此一般不需要回溯出完整的译文
+ * **********************************************************************/
+bool CandOrganizer::is_tgt_same(const Cand *a, const Cand *b)
+{
+	if (a->tgt_len != b->tgt_len || a->tgt_hash != b->tgt_hash || !(a->lm_state == b->lm_state))
 		return false;
-	for (size_t i=0;i<bound_len_a;i++)
+	yield_a.assign(1,YieldItem{a,-1});
+	yield_b.assign(1,YieldItem{b,-1});
+	while (!yield_a.empty() && !yield_b.empty())
 	{
-		if (a->tgt_wids.at(i) != b->tgt_wids.at(i) || a->tgt_wids.at(len_a-1-i) != b->tgt_wids.at(len_b-1-i))
-			return false;
+		YieldItem x = yield_a.back(), y = yield_b.back();
+		if (x.cand != NULL && x.cand == y.cand)                  // 同一个子候选, 两边同时跳过
+		{
+			yield_a.pop_back();
+			yield_b.pop_back();
+		}
+		else if (x.cand != NULL && (y.cand == NULL || x.cand->tgt_len >= y.cand->tgt_len))
+		{
+			yield_a.pop_back();
+			expand_yield(x.cand,yield_a);
+		}
+		else if (y.cand != NULL)
+		{
+			yield_b.pop_back();
+			expand_yield(y.cand,yield_b);
+		}
+		else
+		{
+			if (x.wid != y.wid)
+				return false;
+			yield_a.pop_back();
+			yield_b.pop_back();
+		}
+	}
+	return yield_a.empty() && yield_b.empty();
+}
+
+// 将候选的译文展开为词和子候选的序列, 逆序压入栈中, 与get_tgt_wids的顺序一致
+void CandOrganizer::expand_yield(const Cand *cand, vector<YieldItem> &yield)
+{
+	if (cand->type == OOV)
+	{
+		yield.push_back(YieldItem{NULL,cand->oov_wid});
+	}
+	else if (cand->type == NORMAL)
+	{
+		const TgtRule &applied_rule = cand->matched_rule_group->rules()[cand->rule_rank];
+		size_t nt_idx = cand->cand_rank_vec.size();
+		for (int i=applied_rule.leaf_num-1; i>=0; i--)
+		{
+			if (applied_rule.aligned_src_positions()[i] == -1)
+			{
+				yield.push_back(YieldItem{NULL,applied_rule.tgt_leaves()[i]});
+			}
+			else
+			{
+				nt_idx--;
+				yield.push_back(YieldItem{(*cand->cands_of_nt_leaves)[nt_idx][cand->cand_rank_vec[nt_idx]],-1});
+			}
+		}
+	}
+	else if (cand->type == GLUE)
+	{
+		for (size_t i=cand->cand_rank_vec.size(); i>0; i--)
+		{
+			yield.push_back(YieldItem{(*cand->cands_of_nt_leaves)[i-1][cand->cand_rank_vec[i-1]],-1});
+		}
 	}
-	return true;
 }
 
 void CandOrganizer::sort_and_group_cands()
 {
+	key_to_pos.clear();
 	sort(all_cands.begin(),all_cands.end(),larger);
 	for (auto cand : all_cands)
 	{
@@ -74,3 +182,85 @@ void CandOrganizer::sort_and_group_cands()
 	}
 }
 
+void CandOrganizer::clear()
+{
+	all_cands.clear();
+	tgt_root_to_cand_group.clear();
+	key_to_pos.clear();
+	cand_pool.FreeAll();
+}
+
+void CubeKeySet::clear()
+{
+	key_pool.clear();
+	key_num = 0;
+	key_beg = 0;
+	cur_version++;
+	if (cur_version == 0)                                            // 版本号回绕, 重置所有槽位
+	{
+		for (auto &slot : slots)
+		{
+			slot.version = 0;
+		}
+		cur_version = 1;
+	}
+}
+
+/************************************************************************
+ 1. 函数功能: 将key_pool末尾正在构造的键插入哈希集合
+ 2. 入口参数: 无, 键为key_pool中从key_beg开始的部分
+ 3. 出口参数: 如果键已经存在, 撤销该键并返回false; 否则返回true
+ 4. 算法简介: 线性探测, 只有哈希值相同时才逐个比较键中的整数
+ * **********************************************************************/
+bool CubeKeySet::insert_key()
+{
+	if ( (key_num+1)*2 > slots.size() )
+	{
+		grow();
+	}
+	const int *key = key_pool.data()+key_beg;
+	size_t len = key_pool.size()-key_beg;
+	uint64_t hash = util::MurmurHashNative(key,len*sizeof(int));
+	size_t mask = slots.size()-1;
+	for (size_t i=hash&mask; ; i=(i+1)&mask)
+	{
+		Slot &slot = slots[i];
+		if (slot.version != cur_version)
+		{
+			slot.hash    = hash;
+			slot.beg     = key_beg;
+			slot.len     = len;
+			slot.version = cur_version;
+			key_num++;
+			return true;
+		}
+		if (slot.hash == hash && slot.len == len && equal(key,key+len,key_pool.data()+slot.beg))
+		{
+			key_pool.resize(key_beg);
+			return false;
+		}
+	}
+}
+
+void CubeKeySet::grow()
+{
+	vector<Slot> old_slots;
+	old_slots.swap(slots);
+	slots.resize(max(old_slots.size()*2,(size_t)1024));
+	for (auto &slot : slots)
+	{
+		slot.version = 0;
+	}
+	size_t mask = slots.size()-1;
+	for (const auto &old_slot : old_slots)
+	{
+		if (old_slot.version != cur_version)
+			continue;
+		size_t i = old_slot.hash&mask;
+		while (slots[i].version == cur_version)
+		{
+			i = (i+1)&mask;
+		}
+		slots[i] = old_slot;
+	}
+}
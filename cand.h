@@ -3,107 +3,185 @@
 #include "stdafx.h"
 #include "ruletable.h"
 #include "lm/left.hh"
+#include "util/murmur_hash.hh"
+#include "util/pool.hh"
 
-//存储翻译候选
+// 从内存池中分配内存的STL分配器, 释放时不做任何操作, 内存随内存池一起释放
+template <class T> class PoolAllocator
+{
+	public:
+		typedef T value_type;
+		PoolAllocator(util::Pool *i_pool) : pool(i_pool) {}
+		template <class U> PoolAllocator(const PoolAllocator<U> &other) : pool(other.pool) {}
+		T* allocate(size_t n) {return static_cast<T*>(pool->Allocate((n*sizeof(T)+7)/8*8));}  // 按8字节对齐
+		void deallocate(T *, size_t) {}
+		template <class U> bool operator==(const PoolAllocator<U> &rhs) const {return pool == rhs.pool;}
+		template <class U> bool operator!=(const PoolAllocator<U> &rhs) const {return pool != rhs.pool;}
+
+	public:
+		util::Pool *pool;
+};
+
+struct Cand;
+template <class T> using PoolVector = vector<T,PoolAllocator<T> >;
+typedef PoolVector<Cand*> CandList;
+typedef PoolVector<CandList> CandLists;
+typedef PoolVector<int> IntList;
+
+const uint64_t TGT_HASH_BASE = 0x9E3779B97F4A7C15ULL;   // 译文多项式哈希的底数
+
+//存储翻译候选, 所有成员都从句法节点的内存池中分配, 不需要析构
+//候选不保存完整译文, 只保存来源信息(指向子候选的指针)和语言模型状态, 需要时通过get_tgt_wids回溯得到译文
 struct Cand	                
 {
 	//目标端信息
 	int tgt_root;               //当前候选目标端的根节点
-	vector<int> tgt_wids;		//当前候选译文的单词id序列
+	int tgt_len;                //当前候选译文的长度
+	uint64_t tgt_hash;          //译文的多项式哈希值, 由规则中的词和子候选的哈希值组合得到, 候选重组用
+	uint64_t tgt_hash_pow;      //TGT_HASH_BASE的tgt_len次方, 组合哈希值时用
+	int oov_wid;                //OOV候选的译文单词id
 
 	//打分信息
 	double score;				//当前候选的总得分
-	vector<double> trans_probs;	//翻译概率
+	double heuristic_score;     //立方体剪枝时的排序得分, 在总得分的基础上加入对左边界词语言模型得分的估计
+	double trans_probs[PROB_NUM];	//翻译概率
 	double lm_prob;
+	double lm_left_estimate;    //左边界词的rest cost与概率之差的和, 即这些词得到上文后语言模型得分变化的估计
 
 	//来源信息, 记录候选是如何生成的
 	CandType type;                                 // 候选的类型(1.由OOV生成; 2.由普通规则生成; 3.由glue规则生成)
-	string syntax_node_info;                       // 当前候选所对应的句法节点信息(包括句法标签和跨度), 输出规则信息时用
-	RuleTrieNode* rule_node;                       // 生成当前候选的规则的源端
-	vector<TgtRule>* matched_tgt_rules;            // 目标端非终结符相同的一组规则
-	int rule_rank;                                 // 当前候选所用的规则在matched_tgt_rules中的排名
-	vector<vector<Cand*> > cands_of_nt_leaves;     // 规则源端非终结符叶节点的翻译候选(glue规则所有叶节点均为非终结符)
-	vector<int> cand_rank_vec;                     // 记录当前候选所用的每个非终结符叶节点的翻译候选的排名
-	vector<int> tgt_root_of_leaf_cands;            // 记录源端非终结符叶节点的翻译候选的目标端根节点, 判断候选是否被重复扩展用
+	SyntaxNode* syntax_node;                       // 当前候选所对应的句法节点, 输出规则信息时用
+	const RuleTrieNode* rule_node;                 // 生成当前候选的规则的源端
+	const RuleGroup* matched_rule_group;           // 目标端非终结符相同的一组规则
+	int rule_group_idx;                            // matched_rule_group在rule_node的所有规则组中的序号, 规则块重新加载后地址会变, 序号不变
+	int rule_rank;                                 // 当前候选所用的规则在matched_rule_group中的排名
+	const CandLists *cands_of_nt_leaves;           // 规则源端非终结符叶节点的翻译候选(glue规则所有叶节点均为非终结符),
+	                                               // 由同一规则组(或glue规则)在当前节点生成的候选共享, 候选自己只记录排名
+	IntList cand_rank_vec;                         // 记录当前候选所用的每个非终结符叶节点的翻译候选的排名
 	int rule_num;                                  // 使用的规则的数量
+	bool is_unary;                                 // 是否为一元规则扩展已有候选得到的候选
+	Cand *next_recombined;                         // 与当前候选重组的下一个候选, 被保留的候选由此串起等价类中的所有候选, 抽取k-best推导用
 
 	//语言模型状态信息
 	lm::ngram::ChartState lm_state;
 
-	Cand ()
+	Cand (const PoolAllocator<int> &alloc)
+		: cand_rank_vec(alloc)
 	{
 		tgt_root = -1;
-		tgt_wids.clear();
+		tgt_len  = 0;
+		tgt_hash = 0;
+		tgt_hash_pow = 1;
+		oov_wid  = -1;
 
 		score = 0.0;
-		trans_probs.resize(PROB_NUM,0);
+		heuristic_score = 0.0;
+		fill(trans_probs,trans_probs+PROB_NUM,0.0);
 		lm_prob = 0.0;
+		lm_left_estimate = 0.0;
 
 		type = INIT;
+		syntax_node = NULL;
 		rule_node = NULL;
-		matched_tgt_rules = NULL;
+		matched_rule_group = NULL;
+		rule_group_idx = -1;
+		cands_of_nt_leaves = NULL;
 		rule_rank = 0;
-		cands_of_nt_leaves.clear();
-		cand_rank_vec.clear();
-		tgt_root_of_leaf_cands.clear();
 		rule_num  = 0;
+		is_unary  = false;
+		next_recombined = NULL;
 	}
-	~Cand ()
+	void append_word(int wid)                      // 在译文末尾加入一个词, 更新长度和哈希值
 	{
-		tgt_root = -1;
-		tgt_wids.resize(0);
-
-		score = 0.0;
-		trans_probs.resize(0);
-		lm_prob = 0.0;
-
-		type = INIT;
-		rule_node = NULL;
-		matched_tgt_rules = NULL;
-		rule_rank = 0;
-		cands_of_nt_leaves.resize(0);
-		cand_rank_vec.resize(0);
-		tgt_root_of_leaf_cands.resize(0);
-		rule_num  = 0;
+		tgt_len++;
+		tgt_hash = tgt_hash*TGT_HASH_BASE + (uint64_t)wid;
+		tgt_hash_pow *= TGT_HASH_BASE;
+	}
+	void append_cand(const Cand *subcand)          // 在译文末尾拼接子候选的译文, 更新长度和哈希值
+	{
+		tgt_len += subcand->tgt_len;
+		tgt_hash = tgt_hash*subcand->tgt_hash_pow + subcand->tgt_hash;
+		tgt_hash_pow *= subcand->tgt_hash_pow;
 	}
+	void get_tgt_wids(vector<int> &wids) const;
 };
 
 struct smaller
 {
 	bool operator() ( const Cand *pl, const Cand *pr )
 	{
-		return pl->score < pr->score;
+		return pl->heuristic_score < pr->heuristic_score;
 	}
 };
 
 bool larger( const Cand *pl, const Cand *pr );
 
 //组织每个句法节点翻译候选的类
+//每个句法节点只由一个线程处理, 该节点的所有候选(包括被丢弃的)都从节点自己的内存池中分配, 不需要加锁,
+//候选之间的引用只指向子节点, 因此句子翻译结束删除句法树时统一释放即可
 class CandOrganizer
 {
 	public:
-		~CandOrganizer()
+		Cand* new_cand()
+		{
+			return new (cand_pool.Allocate(sizeof(Cand))) Cand(allocator());
+		}
+		CandLists* new_cand_lists()                      // 分配由多个候选共享的叶节点候选列表
 		{
-			for (auto cand : all_cands)
-			{
-				delete cand;
-			}
-			for (auto cand : recombined_cands)
-			{
-				delete cand;
-			}
+			return new (cand_pool.Allocate(sizeof(CandLists))) CandLists(allocator());
 		}
+		PoolAllocator<int> allocator() {return PoolAllocator<int>(&cand_pool);};
 		bool add(Cand *&cand_ptr);
 		void sort_and_group_cands();
+		void clear();                                    // 删除所有候选, 由粗到精解码时在两遍搜索之间调用
+		static size_t get_recombine_key(const Cand *cand);
 	private:
-		bool is_bound_same(const Cand *a, const Cand *b);
+		struct YieldItem                                 // 候选译文中的一项: 子候选, 或者cand为NULL时的一个词
+		{
+			const Cand *cand;
+			int wid;
+		};
+		bool is_tgt_same(const Cand *a, const Cand *b);
+		static void expand_yield(const Cand *cand, vector<YieldItem> &yield);
 
 	public:
 		vector<Cand*> all_cands;                         // 当前节点所有的翻译候选
-		vector<Cand*> recombined_cands;                  // 被重组的翻译候选, 回溯查看所用规则的时候使用
 		map<int,vector<Cand*> > tgt_root_to_cand_group;  // 将当前节点的翻译候选按照目标端的根节点进行分组
+	private:
+		unordered_multimap<size_t,size_t> key_to_pos;    // 候选重组用的哈希值到候选在all_cands中位置的映射, 排序之后不再使用
+		util::Pool cand_pool;                            // 当前节点所有候选及其数组的内存池
+		vector<YieldItem> yield_a,yield_b;               // 比较两个候选译文时展开推导用的栈
 };
 
 typedef priority_queue<Cand*, vector<Cand*>, smaller> Candpq;
 
+//立方体剪枝中判断候选是否被重复扩展的哈希集合
+//键为立方体标识, 规则排名和叶节点候选排名组成的变长整数序列(叶节点数没有上限), 直接写在key_pool的末尾; 哈希表采用开放地址法, 槽位只记录键的哈希值和位置,
+//清空时只增加版本号, 因此可以在句法节点之间反复使用, 扩展邻居时不再分配内存
+class CubeKeySet
+{
+	public:
+		CubeKeySet() : cur_version(1), key_num(0), key_beg(0) {}
+		void clear();
+		void new_key() {key_beg = key_pool.size();}          // 开始构造一个新键
+		void push(int v) {key_pool.push_back(v);}             // 向新键中加入一个整数
+		bool insert_key();                                    // 插入新键, 若键已存在则撤销该键并返回false
+	private:
+		struct Slot
+		{
+			uint64_t hash;
+			uint32_t beg;                                     // 键在key_pool中的起始位置
+			uint32_t len;                                     // 键的长度
+			uint32_t version;                                 // 与cur_version相同时槽位有效
+		};
+		void grow();
+
+	private:
+		vector<Slot> slots;                                   // 哈希表, 大小为2的幂
+		vector<int> key_pool;                                 // 依次存放所有键
+		uint32_t cur_version;
+		size_t key_num;
+		size_t key_beg;                                       // 正在构造的键的起始位置
+};
+
 #endif
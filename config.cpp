@@ -0,0 +1,175 @@
+#include "config.h"
+
+void read_config(Filenames &fns,Parameter &para, Weight &weight, const string &config_file)
+{
+	ifstream fin;
+	fin.open(config_file.c_str());
+	if (!fin.is_open())
+	{
+		cerr<<"fail to open config file\n";
+		return;
+	}
+	string line;
+	while(getline(fin,line))
+	{
+		TrimLine(line);
+		if (line == "[input-file]")
+		{
+			getline(fin,line);
+			fns.input_file = line;
+		}
+		else if (line == "[output-file]")
+		{
+			getline(fin,line);
+			fns.output_file = line;
+		}
+		else if (line == "[nbest-file]")
+		{
+			getline(fin,line);
+			fns.nbest_file = line;
+		}
+		else if (line == "[src-vocab-file]")
+		{
+			getline(fin,line);
+			fns.src_vocab_file = line;
+		}
+		else if (line == "[tgt-vocab-file]")
+		{
+			getline(fin,line);
+			fns.tgt_vocab_file = line;
+		}
+		else if (line == "[rule-table-file]")
+		{
+			getline(fin,line);
+			fns.rule_table_file = line;
+		}
+		else if (line == "[lm-file]")
+		{
+			getline(fin,line);
+			fns.lm_file = line;
+		}
+		else if (line == "[coarse-lm-file]")
+		{
+			getline(fin,line);
+			fns.coarse_lm_file = line;
+		}
+		else if (line == "[BEAM-SIZE]")
+		{
+			getline(fin,line);
+			para.BEAM_SIZE = stoi(line);
+		}
+		else if (line == "[BEAM-THRESHOLD]")
+		{
+			getline(fin,line);
+			para.BEAM_THRESHOLD = stod(line);
+		}
+		else if (line == "[BEAM-SIZE-PER-WORD]")
+		{
+			getline(fin,line);
+			para.BEAM_SIZE_PER_WORD = stoi(line);
+		}
+		else if (line == "[LM-LEFT-ESTIMATE]")
+		{
+			getline(fin,line);
+			para.LM_LEFT_ESTIMATE = stoi(line);
+		}
+		else if (line == "[COARSE-THRESHOLD]")
+		{
+			getline(fin,line);
+			para.COARSE_THRESHOLD = stod(line);
+		}
+		else if (line == "[SEN-TIME-BUDGET]")
+		{
+			getline(fin,line);
+			para.SEN_TIME_BUDGET = stod(line);
+		}
+		else if (line == "[THREAD-NUM]")
+		{
+			getline(fin,line);
+			para.THREAD_NUM = stoi(line);
+		}
+		else if (line == "[SEN-THREAD-NUM]")
+		{
+			getline(fin,line);
+			para.SEN_THREAD_NUM = stoi(line);
+		}
+		else if (line == "[SPAN-THREAD-NUM]")
+		{
+			getline(fin,line);
+			para.SPAN_THREAD_NUM = stoi(line);
+		}
+		else if (line == "[NBEST-NUM]")
+		{
+			getline(fin,line);
+			para.NBEST_NUM = stoi(line);
+		}
+		else if (line == "[RULE-NUM-LIMIT]")
+		{
+			getline(fin,line);
+			para.RULE_NUM_LIMIT = stoi(line);
+		}
+		else if (line == "[LOAD-THREAD-NUM]")
+		{
+			getline(fin,line);
+			para.LOAD_THREAD_NUM = stoi(line);
+		}
+		else if (line == "[RULE-CACHE-SIZE]")
+		{
+			getline(fin,line);
+			para.RULE_CACHE_SIZE = stoi(line);
+		}
+		else if (line == "[PROB-BITS]")
+		{
+			getline(fin,line);
+			para.PROB_BITS = stoi(line);
+		}
+		else if (line == "[PRINT-NBEST]")
+		{
+			getline(fin,line);
+			para.PRINT_NBEST = stoi(line);
+		}
+		else if (line == "[DUMP-RULE]")
+		{
+			getline(fin,line);
+			para.DUMP_RULE = stoi(line);
+		}
+		else if (line == "[LOAD-ALIGNMENT]")
+		{
+			getline(fin,line);
+			para.LOAD_ALIGNMENT = stoi(line);
+		}
+		else if (line == "[weight]")
+		{
+			while(getline(fin,line))
+			{
+				if (line == "")
+					break;
+				stringstream ss(line);
+				string feature;
+				ss >> feature;
+				if (feature.find("trans") != string::npos)
+				{
+					double w;
+					ss>>w;
+					weight.trans.push_back(w);
+				}
+				else if(feature == "len")
+				{
+					ss>>weight.len;
+				}
+				else if(feature == "lm")
+				{
+					ss>>weight.lm;
+				}
+				else if(feature == "rule-num")
+				{
+					ss>>weight.rule_num;
+				}
+			}
+		}
+	}
+	if (para.THREAD_NUM == 0)                                 // 兼容只设置了SEN-THREAD-NUM和SPAN-THREAD-NUM的旧配置文件
+	{
+		para.THREAD_NUM = max((size_t)1,para.SEN_THREAD_NUM*para.SPAN_THREAD_NUM);
+	}
+}
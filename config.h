@@ -0,0 +1,8 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include "stdafx.h"
+#include "myutils.h"
+
+void read_config(Filenames &fns,Parameter &para, Weight &weight, const string &config_file);
+
+#endif
@@ -0,0 +1,104 @@
+#include "config.h"
+#include "ruletable.h"
+#include "syntaxtree.h"
+#include "util/file.hh"
+
+/**************************************************************************************
+ 根据测试集过滤规则表: 用与解码时相同的匹配方式, 对输入文件中每棵句法树的每个节点查找
+ 匹配的规则, 只保留能被匹配到的规则Trie节点上的规则, 写成新的rule.bin.
+ 用法: filter_ruletable input-trees filtered-rule.bin, 其他文件名和参数从config.ini读取
+***************************************************************************************/
+
+// 记录规则Trie节点从根节点开始的路径, 即规则源端每一层在源端词表中的id
+vector<int> get_rule_path(const RuleTrieNode *rule_node)
+{
+	vector<int> path;
+	while (rule_node->father() != NULL)
+	{
+		path.push_back(rule_node->rule_level_id);
+		rule_node = rule_node->father();
+	}
+	reverse(path.begin(),path.end());
+	return path;
+}
+
+void collect_matched_paths(RuleTable *ruletable, SyntaxNode *node, set<vector<int> > &matched_paths)
+{
+	for (const auto &rule_match_info : ruletable->find_matched_rules_for_syntax_node(node))
+	{
+		matched_paths.insert(get_rule_path(rule_match_info.rule_node));
+	}
+	for (const auto child : node->children)
+	{
+		collect_matched_paths(ruletable,child,matched_paths);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3)
+	{
+		cerr<<"usage: filter_ruletable input-trees filtered-rule.bin\n";
+		return 1;
+	}
+	Filenames fns;
+	Parameter para;
+	Weight weight;
+	read_config(fns,para,weight,"config.ini");
+
+	// 过滤只需要规则Trie树的结构, 每个节点只加载一条规则即可
+	Vocab *src_vocab = new Vocab(fns.src_vocab_file);
+	Vocab *tgt_vocab = new Vocab(fns.tgt_vocab_file);
+	RuleTable *ruletable = new RuleTable(1,para.LOAD_ALIGNMENT,para.LOAD_THREAD_NUM,0,0,weight,fns.rule_table_file,src_vocab,tgt_vocab);
+
+	ifstream fin(argv[1]);
+	if (!fin.is_open())
+	{
+		cerr<<"cannot open input file!\n";
+		return 1;
+	}
+	set<vector<int> > matched_paths;
+	string line;
+	size_t sen_num = 0;
+	while(getline(fin,line))
+	{
+		TrimLine(line);
+		SyntaxTree src_tree(line,ruletable);
+		if (src_tree.root != NULL)
+		{
+			collect_matched_paths(ruletable,src_tree.root,matched_paths);
+		}
+		sen_num++;
+	}
+
+	// 顺序扫描原规则表, 源端路径被匹配到的规则原样写出
+	util::scoped_fd fd(util::OpenReadOrThrow(fns.rule_table_file.c_str()));
+	util::scoped_memory file_memory;
+	util::MapRead(util::POPULATE_OR_READ,fd.get(),0,util::SizeOrThrow(fd.get()),file_memory);
+	util::scoped_fd out_fd(util::CreateOrThrow(argv[2]));
+	const char *p = file_memory.begin(), *end = file_memory.end();
+	size_t rule_num = 0, kept_rule_num = 0;
+	vector<int> path;
+	while (p < end)
+	{
+		size_t rule_size = ruletable->get_rule_size(p,end);
+		if (rule_size == 0)
+		{
+			cerr<<"rule table "<<fns.rule_table_file<<" is truncated or corrupt at byte "<<(p-file_memory.begin())<<", filtered rule table is incomplete!\n";
+			return 1;
+		}
+		short int src_rule_len;
+		memcpy(&src_rule_len,p,sizeof(short int));
+		path.resize(src_rule_len);
+		memcpy(path.data(),p+sizeof(short int),sizeof(int)*src_rule_len);
+		if (matched_paths.count(path) != 0)
+		{
+			util::WriteOrThrow(out_fd.get(),p,rule_size);
+			kept_rule_num++;
+		}
+		rule_num++;
+		p += rule_size;
+	}
+	cout<<"filter rule table with "<<sen_num<<" sentences, keep "<<kept_rule_num<<" of "<<rule_num<<" rules\n";
+	return 0;
+}
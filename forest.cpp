@@ -0,0 +1,348 @@
+#include "forest.h"
+
+static const char FOREST_MAGIC[8] = {'T','2','T','F','O','R','S','T'};
+static const int32_t FOREST_VERSION = 1;
+
+ForestWriter::ForestWriter(const string &forest_file, int i_feature_num)
+{
+	feature_num = i_feature_num;
+	fout.open(forest_file.c_str(),ios::binary);
+	if (!fout.is_open())
+	{
+		cerr<<"cannot open forest file "<<forest_file<<endl;
+		return;
+	}
+	fout.write(FOREST_MAGIC,sizeof(FOREST_MAGIC));
+	write_int(FOREST_VERSION);
+	write_int(feature_num);
+}
+
+void ForestWriter::write_string(const string &s)
+{
+	write_int(s.size());
+	fout.write(s.data(),s.size());
+}
+
+void ForestWriter::write_forest(const Forest &forest)
+{
+	fout.write((const char*)&forest.sen_id,sizeof(uint64_t));
+	write_int(forest.words.size());
+	for (const auto &word : forest.words)
+	{
+		write_string(word);
+	}
+	write_int(forest.nodes.size());
+	for (const auto &node : forest.nodes)
+	{
+		write_int(node.span_lbound);
+		write_int(node.span_rbound);
+		write_string(node.label);
+	}
+	write_int(forest.vertices.size());
+	for (const auto &vertex : forest.vertices)
+	{
+		write_int(vertex.syntax_node);
+		write_int(vertex.tgt_root);
+	}
+	write_int(forest.edges.size());
+	for (const auto &edge : forest.edges)
+	{
+		write_int(edge.head);
+		write_int(edge.type);
+		write_int(edge.tails.size());
+		fout.write((const char*)edge.tails.data(),edge.tails.size()*sizeof(int));
+		write_int(edge.tgt_template.size());
+		fout.write((const char*)edge.tgt_template.data(),edge.tgt_template.size()*sizeof(int));
+		fout.write((const char*)edge.features.data(),feature_num*sizeof(double));
+		fout.write((const char*)&edge.score,sizeof(double));
+	}
+	write_int(forest.goals.size());
+	fout.write((const char*)forest.goals.data(),forest.goals.size()*sizeof(int));
+}
+
+ForestReader::ForestReader(const string &forest_file)
+{
+	is_valid = false;
+	feature_num = 0;
+	file_size = 0;
+	fin.open(forest_file.c_str(),ios::binary);
+	if (!fin.is_open())
+	{
+		cerr<<"cannot open forest file "<<forest_file<<endl;
+		return;
+	}
+	fin.seekg(0,ios::end);
+	file_size = fin.tellg();
+	fin.seekg(0,ios::beg);
+	char magic[8];
+	int32_t version;
+	if ( !fin.read(magic,sizeof(magic)) || memcmp(magic,FOREST_MAGIC,sizeof(magic)) != 0
+	     || !read_int(version) || version != FOREST_VERSION || !read_int(feature_num)
+	     || feature_num < 0 || (uint64_t)feature_num > file_size/sizeof(double) )
+	{
+		cerr<<"forest file "<<forest_file<<" is broken or has a wrong version!\n";
+		return;
+	}
+	is_valid = true;
+}
+
+// 读取元素个数, 每个元素至少占item_size字节, 个数为负或超过文件剩余字节所能容纳的数量时返回false
+bool ForestReader::read_count(int32_t &n, size_t item_size)
+{
+	if (!read_int(n) || n < 0)
+		return false;
+	streamoff pos = fin.tellg();
+	if (pos < 0 || (uint64_t)pos > file_size)
+		return false;
+	return (uint64_t)n <= (file_size-pos)/item_size;
+}
+
+bool ForestReader::read_string(string &s)
+{
+	int32_t len;
+	if (!read_count(len,1))
+		return false;
+	s.resize(len);
+	return len == 0 || (bool)fin.read(&s[0],len);
+}
+
+// 读取一个序号, 并检查它位于[lbound,rbound)之内
+bool ForestReader::read_index(int32_t &v, int32_t lbound, int32_t rbound)
+{
+	return read_int(v) && v >= lbound && v < rbound;
+}
+
+// 报告森林文件损坏, 之后不再读取
+bool ForestReader::report_error(const string &msg)
+{
+	cerr<<"forest file is broken: "<<msg<<endl;
+	is_valid = false;
+	return false;
+}
+
+/************************************************************************
+ 1. 函数功能: 读取下一个句子的翻译森林
+ 2. 入口参数: 无
+ 3. 出口参数: 读取的森林
+ 4. 算法简介: 按照ForestWriter::write_forest的顺序读取, 文件结束时返回false;
+              分配内存之前检查每个个数不超过文件剩余的字节数, 并检查所有序号的范围
+              (尾节点须排在头节点之前, 保证森林无环), 数据不完整或有误时报错并返回false
+ * **********************************************************************/
+bool ForestReader::read_forest(Forest &forest)
+{
+	if (!is_valid)
+		return false;
+	int32_t n;
+	if ( !fin.read((char*)&forest.sen_id,sizeof(uint64_t)) )
+		return fin.gcount() == 0 ? false : report_error("incomplete sentence id");
+	if (!read_count(n,sizeof(int32_t)))
+		return report_error("bad word number of sentence "+to_string(forest.sen_id));
+	forest.words.resize(n);
+	for (auto &word : forest.words)
+	{
+		if (!read_string(word))
+			return report_error("bad word in sentence "+to_string(forest.sen_id));
+	}
+	if (!read_count(n,3*sizeof(int32_t)))
+		return report_error("bad syntax node number of sentence "+to_string(forest.sen_id));
+	forest.nodes.resize(n);
+	for (auto &node : forest.nodes)
+	{
+		if ( !read_int(node.span_lbound) || !read_int(node.span_rbound) || !read_string(node.label) )
+			return report_error("bad syntax node in sentence "+to_string(forest.sen_id));
+	}
+	if (!read_count(n,2*sizeof(int32_t)))
+		return report_error("bad vertex number of sentence "+to_string(forest.sen_id));
+	forest.vertices.resize(n);
+	for (auto &vertex : forest.vertices)
+	{
+		if ( !read_index(vertex.syntax_node,0,forest.nodes.size()) || !read_index(vertex.tgt_root,0,forest.words.size()) )
+			return report_error("bad vertex in sentence "+to_string(forest.sen_id));
+	}
+	if (!read_count(n,4*sizeof(int32_t)+(feature_num+1)*sizeof(double)))
+		return report_error("bad edge number of sentence "+to_string(forest.sen_id));
+	forest.edges.resize(n);
+	for (auto &edge : forest.edges)
+	{
+		if ( !read_index(edge.head,0,forest.vertices.size()) || !read_index(edge.type,OOV,GLUE+1) || !read_count(n,sizeof(int32_t)) )
+			return report_error("bad edge in sentence "+to_string(forest.sen_id));
+		edge.tails.resize(n);
+		for (auto &tail : edge.tails)
+		{
+			if (!read_index(tail,0,edge.head))
+				return report_error("bad tail of edge in sentence "+to_string(forest.sen_id));
+		}
+		if (!read_count(n,sizeof(int32_t)))
+			return report_error("bad edge in sentence "+to_string(forest.sen_id));
+		edge.tgt_template.resize(n);
+		for (auto &v : edge.tgt_template)
+		{
+			if (!read_index(v,-(int32_t)edge.tails.size(),forest.words.size()))
+				return report_error("bad target template of edge in sentence "+to_string(forest.sen_id));
+		}
+		edge.features.resize(feature_num);
+		if ( !fin.read((char*)edge.features.data(),feature_num*sizeof(double))
+		     || !fin.read((char*)&edge.score,sizeof(double)) )
+			return report_error("incomplete edge in sentence "+to_string(forest.sen_id));
+	}
+	if (!read_count(n,sizeof(int32_t)))
+		return report_error("bad goal number of sentence "+to_string(forest.sen_id));
+	forest.goals.resize(n);
+	for (auto &goal : forest.goals)
+	{
+		if (!read_index(goal,0,forest.vertices.size()))
+			return report_error("bad goal in sentence "+to_string(forest.sen_id));
+	}
+	return true;
+}
+
+// 超边的局部得分: 特征与权重的内积
+double score_forest_edge(const ForestEdge &edge, const Weight &weight)
+{
+	const vector<double> &f = edge.features;
+	double score = 0;
+	for (size_t i=0; i<weight.trans.size(); i++)
+	{
+		score += weight.trans[i]*f[i];
+	}
+	size_t n = weight.trans.size();
+	score += weight.lm*f[n] + weight.len*f[n+1] + weight.rule_num*f[n+2];
+	return score;
+}
+
+void rescore_forest(Forest &forest, const Weight &weight)
+{
+	for (auto &edge : forest.edges)
+	{
+		edge.score = score_forest_edge(edge,weight);
+	}
+}
+
+ForestKbest::ForestKbest(const Forest &i_forest) : forest(i_forest)
+{
+	in_edges.resize(forest.vertices.size());
+	for (size_t i=0; i<forest.edges.size(); i++)
+	{
+		in_edges[forest.edges[i].head].push_back(i);
+	}
+	vertices.resize(forest.vertices.size());
+	goal_next_rank.resize(forest.goals.size(),0);
+	for (size_t i=0; i<forest.goals.size(); i++)
+	{
+		if ( lazy_kth_best(forest.goals[i],1) )
+		{
+			goal_pq.push( make_pair(vertices[forest.goals[i]].derivations[0]->score,i) );
+		}
+	}
+}
+
+// 对各目标节点的推导列表做归并, 每取出一个推导才计算该列表的下一个推导
+const ForestDerivation* ForestKbest::get_kth_best(size_t k)
+{
+	while (kbest.size() <= k)
+	{
+		if (goal_pq.empty())
+			return NULL;
+		size_t idx = goal_pq.top().second;
+		goal_pq.pop();
+		VertexKbest &vertex = vertices[forest.goals[idx]];
+		kbest.push_back(vertex.derivations[goal_next_rank[idx]]);
+		goal_next_rank[idx]++;
+		if ( lazy_kth_best(forest.goals[idx],goal_next_rank[idx]+1) )
+		{
+			goal_pq.push( make_pair(vertex.derivations[goal_next_rank[idx]]->score,idx) );
+		}
+	}
+	return kbest[k];
+}
+
+// 保证超图节点v至少有k个推导, 做法同KbestExtractor::lazy_kth_best
+bool ForestKbest::lazy_kth_best(int v, size_t k)
+{
+	VertexKbest &vertex = vertices[v];
+	if (!vertex.is_initialized)
+	{
+		vertex.is_initialized = true;
+		for (auto edge : in_edges[v])
+		{
+			push_derivation(vertex,edge,vector<int>(forest.edges[edge].tails.size(),0));
+		}
+	}
+	while (vertex.derivations.size() < k)
+	{
+		if (!vertex.derivations.empty())
+		{
+			const ForestDerivation *last = vertex.derivations.back();
+			for (size_t i=0; i<last->tail_ranks.size(); i++)
+			{
+				vector<int> tail_ranks = last->tail_ranks;
+				tail_ranks[i]++;
+				push_derivation(vertex,last->edge,tail_ranks);
+			}
+		}
+		if (vertex.cand_heap.empty())
+			return false;
+		vertex.derivations.push_back(vertex.cand_heap.top());
+		vertex.cand_heap.pop();
+	}
+	return true;
+}
+
+void ForestKbest::push_derivation(VertexKbest &vertex, int edge, const vector<int> &tail_ranks)
+{
+	const ForestEdge &forest_edge = forest.edges[edge];
+	for (size_t i=0; i<tail_ranks.size(); i++)
+	{
+		if ( !lazy_kth_best(forest_edge.tails[i],tail_ranks[i]+1) )
+			return;
+	}
+	if ( !vertex.seen.insert(make_pair(edge,tail_ranks)).second )
+		return;
+	derivation_pool.push_back(ForestDerivation());
+	ForestDerivation &d = derivation_pool.back();
+	d.edge       = edge;
+	d.tail_ranks = tail_ranks;
+	d.features   = forest_edge.features;
+	d.score      = forest_edge.score;
+	for (size_t i=0; i<tail_ranks.size(); i++)
+	{
+		const ForestDerivation *sub = vertices[forest_edge.tails[i]].derivations[tail_ranks[i]];
+		for (size_t j=0; j<d.features.size(); j++)
+		{
+			d.features[j] += sub->features[j];
+		}
+		d.score += sub->score;
+	}
+	vertex.cand_heap.push(&d);
+}
+
+string ForestKbest::get_translation(const ForestDerivation *d, bool drop_unk)
+{
+	string translation;
+	get_translation(d,drop_unk,translation);
+	if (!translation.empty())
+	{
+		translation.resize(translation.size()-1);                  // 去掉末尾的空格
+	}
+	return translation;
+}
+
+void ForestKbest::get_translation(const ForestDerivation *d, bool drop_unk, string &translation)
+{
+	const ForestEdge &edge = forest.edges[d->edge];
+	for (auto t : edge.tgt_template)
+	{
+		if (t >= 0)
+		{
+			if (forest.words[t] != "NULL" || drop_unk == false)
+			{
+				translation += forest.words[t] + " ";
+			}
+		}
+		else
+		{
+			int tail_idx = -t-1;
+			get_translation(vertices[edge.tails[tail_idx]].derivations[d->tail_ranks[tail_idx]],drop_unk,translation);
+		}
+	}
+}
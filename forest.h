@@ -0,0 +1,123 @@
+#ifndef FOREST_H
+#define FOREST_H
+#include "stdafx.h"
+
+// 翻译森林的二进制格式, 供外部工具(如forest MERT, MBR)读取, 不依赖解码器的其它部分
+// 文件头: 8字节魔数, 版本号, 每条超边的特征数; 之后依次是每个句子的森林
+// 超图节点为某个句法节点上重组后的候选等价类, 超边为一次规则应用, 超边的特征和得分都是局部的,
+// 一个推导的特征等于它所用超边特征之和
+
+struct ForestNode                              // 源端句法树节点
+{
+	int span_lbound;
+	int span_rbound;
+	string label;
+};
+
+struct ForestVertex                            // 超图节点
+{
+	int syntax_node;                           // 所在句法节点的序号
+	int tgt_root;                              // 目标端根节点在单词表中的序号
+};
+
+struct ForestEdge                              // 超边, 尾节点都排在头节点之前
+{
+	int head;                                  // 头节点序号
+	int type;                                  // 生成超边的规则类型, 取值同CandType
+	vector<int> tails;                         // 尾节点序号, 按目标端顺序排列
+	vector<int> tgt_template;                  // 目标端: 非负数为单词表中的序号, -(i+1)表示第i个尾节点的译文
+	vector<double> features;                   // 局部特征: 翻译概率, 语言模型得分, 译文词数, 规则数
+	double score;                              // 局部得分
+};
+
+struct Forest
+{
+	uint64_t sen_id;
+	vector<string> words;                      // 该句森林用到的目标端单词表
+	vector<ForestNode> nodes;
+	vector<ForestVertex> vertices;             // 按拓扑序排列, 子节点在前
+	vector<ForestEdge> edges;
+	vector<int> goals;                         // 根节点上的超图节点, 即整句的译文
+};
+
+// 用新的特征权重重新计算每条超边的局部得分, 特征的顺序与n-best列表相同
+double score_forest_edge(const ForestEdge &edge, const Weight &weight);
+void rescore_forest(Forest &forest, const Weight &weight);
+
+struct ForestDerivation                        // 森林中的一个推导
+{
+	int edge;                                  // 根部的超边
+	vector<int> tail_ranks;                    // 每个尾节点所用推导的排名
+	vector<double> features;                   // 推导的特征, 即所用超边的局部特征之和
+	double score;
+};
+
+// 按照超边的局部得分从森林中惰性地抽取k-best推导(Huang and Chiang, 2005, 算法3), 不需要重新解码
+class ForestKbest
+{
+	public:
+		ForestKbest(const Forest &i_forest);
+		const ForestDerivation* get_kth_best(size_t k);        // 整句第k好(从0开始)的推导, 不存在时返回NULL
+		string get_translation(const ForestDerivation *d, bool drop_unk);  // 推导的译文, drop_unk为true时去掉NULL
+	private:
+		struct DerivationWorse
+		{
+			bool operator() (const ForestDerivation *a, const ForestDerivation *b) const {return a->score < b->score;}
+		};
+		struct VertexKbest
+		{
+			bool is_initialized;
+			vector<const ForestDerivation*> derivations;       // 已找到的推导, 按得分从高到低
+			priority_queue<const ForestDerivation*, vector<const ForestDerivation*>, DerivationWorse> cand_heap;
+			set<pair<int,vector<int> > > seen;                  // 已经加入过cand_heap的(超边,尾节点排名)
+			VertexKbest() : is_initialized(false) {}
+		};
+		bool lazy_kth_best(int v, size_t k);
+		void push_derivation(VertexKbest &vertex, int edge, const vector<int> &tail_ranks);
+		void get_translation(const ForestDerivation *d, bool drop_unk, string &translation);
+
+	private:
+		const Forest &forest;
+		vector<vector<int> > in_edges;                        // 每个超图节点的入边
+		vector<VertexKbest> vertices;
+		deque<ForestDerivation> derivation_pool;
+		priority_queue<pair<double,size_t> > goal_pq;        // 合并各目标节点的推导列表, (得分,目标节点序号)
+		vector<size_t> goal_next_rank;
+		vector<const ForestDerivation*> kbest;
+};
+
+class ForestWriter
+{
+	public:
+		ForestWriter(const string &forest_file, int feature_num);
+		bool is_open() {return fout.is_open();}
+		void write_forest(const Forest &forest);
+	private:
+		void write_int(int32_t v) {fout.write((const char*)&v,sizeof(v));}
+		void write_string(const string &s);
+	private:
+		ofstream fout;
+		int feature_num;
+};
+
+class ForestReader
+{
+	public:
+		ForestReader(const string &forest_file);
+		bool is_open() {return is_valid;}
+		int get_feature_num() {return feature_num;}
+		bool read_forest(Forest &forest);          // 读取下一个句子的森林, 文件结束或出错时返回false
+	private:
+		bool read_int(int32_t &v) {return (bool)fin.read((char*)&v,sizeof(v));}
+		bool read_count(int32_t &n, size_t item_size);
+		bool read_string(string &s);
+		bool read_index(int32_t &v, int32_t lbound, int32_t rbound);
+		bool report_error(const string &msg);
+	private:
+		ifstream fin;
+		bool is_valid;
+		int feature_num;
+		uint64_t file_size;
+};
+
+#endif
@@ -0,0 +1,274 @@
+#include "kbest.h"
+
+KbestExtractor::KbestExtractor(SyntaxNode *root)
+{
+	index_recombined_classes(root,cand_to_head);
+	root_heads.assign(root->cand_organizer.all_cands.begin(),root->cand_organizer.all_cands.end());
+	root_next_rank.resize(root_heads.size(),0);
+	for (size_t i=0; i<root_heads.size(); i++)
+	{
+		VertexKey key = make_pair(root_heads[i],false);
+		if ( lazy_kth_best(key,1) )
+		{
+			root_pq.push( make_pair(get_vertex(key).derivations[0]->score,i) );
+		}
+	}
+}
+
+// 记录每个候选所在的等价类, 被重组的候选通过next_recombined挂在被保留的候选上
+void index_recombined_classes(SyntaxNode *node, unordered_map<const Cand*,const Cand*> &cand_to_head)
+{
+	for (auto head : node->cand_organizer.all_cands)
+	{
+		for (const Cand *cand=head; cand!=NULL; cand=cand->next_recombined)
+		{
+			cand_to_head[cand] = head;
+		}
+	}
+	for (auto child : node->children)
+	{
+		index_recombined_classes(child,cand_to_head);
+	}
+}
+
+/************************************************************************
+ 1. 函数功能: 获取整个句子第k好的推导
+ 2. 入口参数: 推导的排名k, 从0开始
+ 3. 出口参数: 指向推导的指针, 推导总数不足k+1个时返回NULL
+ 4. 算法简介: 根节点的每个等价类都有按得分排好序的推导列表, 用优先级队列
+              对这些列表做归并, 每取出一个推导才计算该列表的下一个推导
+ * **********************************************************************/
+const Derivation* KbestExtractor::get_kth_best(size_t k)
+{
+	while (kbest.size() <= k)
+	{
+		if (root_pq.empty())
+			return NULL;
+		size_t idx = root_pq.top().second;
+		root_pq.pop();
+		VertexKey key = make_pair(root_heads[idx],false);
+		Vertex &vertex = get_vertex(key);
+		kbest.push_back(vertex.derivations[root_next_rank[idx]]);
+		root_next_rank[idx]++;
+		if ( lazy_kth_best(key,root_next_rank[idx]+1) )
+		{
+			root_pq.push( make_pair(vertex.derivations[root_next_rank[idx]]->score,idx) );
+		}
+	}
+	return kbest[k];
+}
+
+KbestExtractor::Vertex& KbestExtractor::get_vertex(const VertexKey &key)
+{
+	return vertices[key];
+}
+
+// 超边第tail_idx个尾节点对应的超图节点; 一元规则候选的尾节点只使用非一元规则生成的候选
+KbestExtractor::VertexKey KbestExtractor::get_tail_key(const Cand *edge, size_t tail_idx)
+{
+	const Cand *tail_cand = (*edge->cands_of_nt_leaves)[tail_idx][edge->cand_rank_vec[tail_idx]];
+	return make_pair(cand_to_head[tail_cand],edge->is_unary);
+}
+
+/************************************************************************
+ 1. 函数功能: 保证超图节点至少有k个推导
+ 2. 入口参数: 超图节点, k
+ 3. 出口参数: 推导数达到k返回true, 否则返回false
+ 4. 算法简介: 第一次访问时把每条超边的最好推导加入候选堆; 之后每次先把上一个
+              取出的推导的邻居(某个尾节点换成下一位推导)加入候选堆, 再取出最好的
+ * **********************************************************************/
+bool KbestExtractor::lazy_kth_best(const VertexKey &key, size_t k)
+{
+	Vertex &vertex = get_vertex(key);
+	if (!vertex.is_initialized)
+	{
+		vertex.is_initialized = true;
+		for (const Cand *edge=key.first; edge!=NULL; edge=edge->next_recombined)
+		{
+			if (key.second == true && edge->is_unary == true)
+				continue;
+			push_derivation(vertex,edge,vector<int>(edge->cand_rank_vec.size(),0));
+		}
+	}
+	while (vertex.derivations.size() < k)
+	{
+		if (!vertex.derivations.empty())
+		{
+			push_successors(vertex,vertex.derivations.back());
+		}
+		if (vertex.cand_heap.empty())
+			return false;
+		vertex.derivations.push_back(vertex.cand_heap.top());
+		vertex.cand_heap.pop();
+	}
+	return true;
+}
+
+// 将超边使用给定尾节点推导得到的推导加入候选堆, 尾节点推导不存在或已经加入过时跳过
+void KbestExtractor::push_derivation(Vertex &vertex, const Cand *edge, const vector<int> &tail_ranks)
+{
+	for (size_t i=0; i<tail_ranks.size(); i++)
+	{
+		if ( !lazy_kth_best(get_tail_key(edge,i),tail_ranks[i]+1) )
+			return;
+	}
+	if ( !vertex.seen.insert(make_pair(edge,tail_ranks)).second )
+		return;
+	derivation_pool.push_back(Derivation());
+	Derivation &d = derivation_pool.back();
+	d.edge       = edge;
+	d.tail_ranks = tail_ranks;
+	d.score      = edge->score;
+	copy(edge->trans_probs,edge->trans_probs+PROB_NUM,d.trans_probs);
+	d.lm_prob    = edge->lm_prob;
+	d.rule_num   = edge->rule_num;
+	for (size_t i=0; i<tail_ranks.size(); i++)
+	{
+		const Cand *tail_cand = (*edge->cands_of_nt_leaves)[i][edge->cand_rank_vec[i]];
+		const Derivation *sub = get_vertex(get_tail_key(edge,i)).derivations[tail_ranks[i]];
+		d.score    += sub->score - tail_cand->score;                            // 把超边实际使用的子候选换成所选的子推导
+		for (size_t j=0; j<PROB_NUM; j++)
+		{
+			d.trans_probs[j] += sub->trans_probs[j] - tail_cand->trans_probs[j];
+		}
+		d.lm_prob  += sub->lm_prob - tail_cand->lm_prob;
+		d.rule_num += sub->rule_num - tail_cand->rule_num;
+	}
+	vertex.cand_heap.push(&d);
+}
+
+void KbestExtractor::push_successors(Vertex &vertex, const Derivation *d)
+{
+	for (size_t i=0; i<d->tail_ranks.size(); i++)
+	{
+		vector<int> tail_ranks = d->tail_ranks;
+		tail_ranks[i]++;
+		push_derivation(vertex,d->edge,tail_ranks);
+	}
+}
+
+/************************************************************************
+ 1. 函数功能: 构建当前句子的翻译森林
+ 2. 入口参数: 无
+ 3. 出口参数: 翻译森林
+ 4. 算法简介: 从根节点的每个等价类出发深度优先遍历超图, 尾节点先于头节点编号,
+              因此超图节点按拓扑序排列; 超边的特征和得分减去尾节点实际所用候选的部分
+ * **********************************************************************/
+void ForestBuilder::build(Forest &forest)
+{
+	index_recombined_classes(root,cand_to_head);
+	add_syntax_node(root,forest);
+	for (auto head : root->cand_organizer.all_cands)
+	{
+		forest.goals.push_back( add_vertex(make_pair(head,false),forest) );
+	}
+}
+
+void ForestBuilder::add_syntax_node(SyntaxNode *node, Forest &forest)
+{
+	if ( node->children.empty() )                                          // 词汇节点上没有候选
+		return;
+	node_ids[node] = forest.nodes.size();
+	forest.nodes.push_back( ForestNode{node->span_lbound,node->span_rbound,node->label} );
+	for (auto child : node->children)
+	{
+		add_syntax_node(child,forest);
+	}
+}
+
+ForestBuilder::VertexKey ForestBuilder::get_tail_key(const Cand *edge, size_t tail_idx)
+{
+	const Cand *tail_cand = (*edge->cands_of_nt_leaves)[tail_idx][edge->cand_rank_vec[tail_idx]];
+	return make_pair(cand_to_head[tail_cand],edge->is_unary);
+}
+
+int ForestBuilder::add_vertex(const VertexKey &key, Forest &forest)
+{
+	auto it = vertex_ids.find(key);
+	if ( it != vertex_ids.end() )
+		return it->second;
+	vector<const Cand*> edges;
+	for (const Cand *edge=key.first; edge!=NULL; edge=edge->next_recombined)
+	{
+		if (key.second == true && edge->is_unary == true)
+			continue;
+		edges.push_back(edge);
+		for (size_t i=0; i<edge->cand_rank_vec.size(); i++)
+		{
+			add_vertex(get_tail_key(edge,i),forest);
+		}
+	}
+	int head = forest.vertices.size();
+	vertex_ids[key] = head;
+	forest.vertices.push_back( ForestVertex{node_ids[key.first->syntax_node],get_word_idx(key.first->tgt_root,forest)} );
+	for (auto edge : edges)
+	{
+		add_edge(edge,head,forest);
+	}
+	return head;
+}
+
+void ForestBuilder::add_edge(const Cand *edge, int head, Forest &forest)
+{
+	ForestEdge forest_edge;
+	forest_edge.head = head;
+	forest_edge.type = edge->type;
+	vector<double> &features = forest_edge.features;
+	features.assign(edge->trans_probs,edge->trans_probs+PROB_NUM);
+	features.push_back(edge->lm_prob);
+	features.push_back(edge->tgt_len);
+	features.push_back(edge->rule_num);
+	forest_edge.score = edge->score;
+	for (size_t i=0; i<edge->cand_rank_vec.size(); i++)
+	{
+		forest_edge.tails.push_back( vertex_ids[get_tail_key(edge,i)] );
+		const Cand *tail_cand = (*edge->cands_of_nt_leaves)[i][edge->cand_rank_vec[i]];
+		for (size_t j=0; j<PROB_NUM; j++)
+		{
+			features[j] -= tail_cand->trans_probs[j];
+		}
+		features[PROB_NUM]   -= tail_cand->lm_prob;
+		features[PROB_NUM+1] -= tail_cand->tgt_len;
+		features[PROB_NUM+2] -= tail_cand->rule_num;
+		forest_edge.score    -= tail_cand->score;
+	}
+	if (edge->type == OOV)
+	{
+		forest_edge.tgt_template.push_back( get_word_idx(edge->oov_wid,forest) );
+	}
+	else if (edge->type == NORMAL)
+	{
+		const TgtRule &applied_rule = edge->matched_rule_group->rules()[edge->rule_rank];
+		int nt_idx = 0;
+		for (int i=0; i<applied_rule.leaf_num; i++)
+		{
+			if (applied_rule.aligned_src_positions()[i] == -1)
+			{
+				forest_edge.tgt_template.push_back( get_word_idx(applied_rule.tgt_leaves()[i],forest) );
+			}
+			else
+			{
+				forest_edge.tgt_template.push_back(-(++nt_idx));
+			}
+		}
+	}
+	else if (edge->type == GLUE)
+	{
+		for (int i=0; i<(int)edge->cand_rank_vec.size(); i++)
+		{
+			forest_edge.tgt_template.push_back(-(i+1));
+		}
+	}
+	forest.edges.push_back(forest_edge);
+}
+
+int ForestBuilder::get_word_idx(int wid, Forest &forest)
+{
+	auto it = word_ids.find(wid);
+	if ( it != word_ids.end() )
+		return it->second;
+	int idx = forest.words.size();
+	word_ids.insert(make_pair(wid,idx));
+	forest.words.push_back(tgt_vocab->get_word(wid));
+	return idx;
+}
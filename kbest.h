@@ -0,0 +1,88 @@
+#ifndef KBEST_H
+#define KBEST_H
+#include "stdafx.h"
+#include "cand.h"
+#include "syntaxtree.h"
+#include "vocab.h"
+#include "forest.h"
+
+void index_recombined_classes(SyntaxNode *node, unordered_map<const Cand*,const Cand*> &cand_to_head);
+
+// 一个推导: 所用的超边(即生成候选的那一次规则应用)以及每个尾节点所用推导的排名
+// 同一等价类中的候选译文和语言模型状态都相同, 因此推导的得分和特征可以由超边的得分和特征
+// 减去超边实际使用的子候选, 再加上所选的子推导得到
+struct Derivation
+{
+	const Cand *edge;                    // 超边, 即当前节点的某个候选(包括被重组的候选)
+	vector<int> tail_ranks;              // 每个尾节点所用推导在该节点推导列表中的排名
+	double score;
+	double trans_probs[PROB_NUM];
+	double lm_prob;
+	int rule_num;
+};
+
+// 从翻译森林中惰性地抽取k-best推导(Huang and Chiang, 2005, 算法3)
+// 超图的节点为句法节点上重组后的候选等价类, 每个等价类的超边为其中所有的候选, 包括被重组的候选;
+// 一元规则候选的尾节点只使用非一元规则生成的候选, 与解码时一元规则只扩展一次一致, 从而避免环
+class KbestExtractor
+{
+	public:
+		KbestExtractor(SyntaxNode *root);
+		const Derivation* get_kth_best(size_t k);           // 第k好(从0开始)的推导, 不存在时返回NULL
+
+	private:
+		typedef pair<const Cand*,bool> VertexKey;           // (等价类中被保留的候选, 是否只使用非一元规则候选)
+		struct DerivationWorse
+		{
+			bool operator() (const Derivation *a, const Derivation *b) const {return a->score < b->score;}
+		};
+		struct Vertex
+		{
+			bool is_initialized;
+			vector<const Derivation*> derivations;             // 已找到的推导, 按得分从高到低
+			priority_queue<const Derivation*, vector<const Derivation*>, DerivationWorse> cand_heap; // 候选推导
+			set<pair<const Cand*,vector<int> > > seen;          // 已经加入过cand_heap的推导
+			Vertex() : is_initialized(false) {}
+		};
+
+		Vertex& get_vertex(const VertexKey &key);
+		VertexKey get_tail_key(const Cand *edge, size_t tail_idx);
+		bool lazy_kth_best(const VertexKey &key, size_t k);
+		void push_derivation(Vertex &vertex, const Cand *edge, const vector<int> &tail_ranks);
+		void push_successors(Vertex &vertex, const Derivation *d);
+
+	private:
+		unordered_map<const Cand*,const Cand*> cand_to_head; // 每个候选所在等价类中被保留的候选
+		map<VertexKey,Vertex> vertices;
+		deque<Derivation> derivation_pool;                   // deque保证推导的地址不变
+		vector<const Cand*> root_heads;                      // 根节点的所有等价类
+		priority_queue<pair<double,size_t> > root_pq;        // 合并根节点各等价类推导列表用, (得分,根节点等价类序号)
+		vector<size_t> root_next_rank;                       // 每个根节点等价类下一个要取出的推导排名
+		vector<const Derivation*> kbest;                     // 已经找到的k-best推导
+};
+
+// 将句子的翻译森林转换为可以写入文件的Forest, 超图节点的划分与KbestExtractor相同
+class ForestBuilder
+{
+	public:
+		ForestBuilder(SyntaxNode *i_root, const SentenceVocab *i_tgt_vocab) : root(i_root), tgt_vocab(i_tgt_vocab) {}
+		void build(Forest &forest);
+
+	private:
+		typedef pair<const Cand*,bool> VertexKey;           // 同KbestExtractor::VertexKey
+		void add_syntax_node(SyntaxNode *node, Forest &forest);
+		VertexKey get_tail_key(const Cand *edge, size_t tail_idx);
+		int add_vertex(const VertexKey &key, Forest &forest);
+		void add_edge(const Cand *edge, int head, Forest &forest);
+		int get_word_idx(int wid, Forest &forest);
+
+	private:
+		SyntaxNode *root;
+		const SentenceVocab *tgt_vocab;
+		unordered_map<const Cand*,const Cand*> cand_to_head;
+		unordered_map<const SyntaxNode*,int> node_ids;
+		map<VertexKey,int> vertex_ids;
+		unordered_map<int,int> word_ids;                     // 目标端单词id到森林单词表序号的映射
+};
+
+#endif
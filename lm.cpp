@@ -5,8 +5,8 @@ struct ID_converter : public lm::EnumerateVocab
 	ID_converter(vector<lm::WordIndex>* out, Vocab* vocab) : sub_to_kenlm_id(out), UNK_ID(0),tgt_vocab(vocab) { sub_to_kenlm_id->clear(); }
 	void Add(lm::WordIndex index, const StringPiece &str) 
 	{
-		const int ori_id = tgt_vocab->get_id(str.as_string());
-		if (ori_id >= sub_to_kenlm_id->size())
+		const int ori_id = tgt_vocab->add_word(str.as_string());
+		if ((size_t)ori_id >= sub_to_kenlm_id->size())
 		{
 			sub_to_kenlm_id->resize(ori_id + 1, UNK_ID);
 		}
@@ -17,69 +17,127 @@ struct ID_converter : public lm::EnumerateVocab
 	Vocab* tgt_vocab;
 };
 
-LanguageModel::LanguageModel(const string &lm_file, Vocab *tgt_vocab)
+/**************************************************************************************
+ 1. 函数功能: 加载语言模型
+ 2. 入口参数: 语言模型文件, 目标端单词表, 是否使用rest cost估计左边界词的得分
+ 3. 出口参数: 无
+ 4. 算法简介: 二进制文件按文件中记录的类型加载; ARPA文件在use_rest_cost为true时
+              加载为RestProbingModel, 加载时计算每个n元语法的rest cost(REST_MAX)
+***************************************************************************************/
+LanguageModel::LanguageModel(const string &lm_file, Vocab *tgt_vocab, bool use_rest_cost)
+{
+	kenlm = NULL;
+	rest_kenlm = NULL;
+	ModelType model_type;
+	if ( !RecognizeBinary(lm_file.c_str(),model_type) )
+	{
+		model_type = use_rest_cost ? REST_PROBING : PROBING;
+	}
+	if (model_type == REST_PROBING)
+	{
+		rest_kenlm = load_model<RestProbingModel>(lm_file,tgt_vocab);
+	}
+	else
+	{
+		if (use_rest_cost)
+		{
+			cerr<<"warning: language model "<<lm_file<<" has no rest costs, left boundary estimate is disabled\n";
+		}
+		kenlm = load_model<ProbingModel>(lm_file,tgt_vocab);
+	}
+	EOS = convert_to_kenlm_id(tgt_vocab->add_word("</s>"));
+	cout<<"load language model file "<<lm_file<<" over\n";
+};
+
+template <class M> M* LanguageModel::load_model(const string &lm_file, Vocab *tgt_vocab)
 {
 	ID_converter id_converter(&ori_to_kenlm_id,tgt_vocab);
 	Config conf;
 	conf.enumerate_vocab = &id_converter;
-	kenlm = new Model(lm_file.c_str(), conf);
-	EOS = convert_to_kenlm_id(tgt_vocab->get_id("</s>"));
-	cout<<"load language model file "<<lm_file<<" over\n";
-};
+	conf.rest_function = Config::REST_MAX;
+	return new M(lm_file.c_str(), conf);
+}
 
 lm::WordIndex LanguageModel::convert_to_kenlm_id(int wid)
 {
-	if (wid >= ori_to_kenlm_id.size())
+	if ((size_t)wid >= ori_to_kenlm_id.size())
 		return 0;
 	else
 		return ori_to_kenlm_id[wid];
 }
 
-double LanguageModel::cal_increased_lm_score(Cand* cand) 
+double LanguageModel::cal_increased_lm_score(Cand* cand)
+{
+	if (rest_kenlm != NULL)
+		return cal_increased_lm_score(*rest_kenlm,cand);
+	return cal_increased_lm_score(*kenlm,cand);
+}
+
+/**************************************************************************************
+ 1. 函数功能: 计算候选的语言模型得分增量
+ 2. 入口参数: 语言模型, 候选
+ 3. 出口参数: 得分增量, 同时更新候选的语言模型状态和左边界估计
+ 4. 算法简介: RuleScore返回的增量中左边界词用的是rest cost; 候选的左边界估计为其左状态中
+              各词rest cost与概率之差的和, 由UnRest得到, 增量减去自己的估计并加回子候选的
+              估计即为按概率计算的增量; 不带rest cost的模型UnRest恒为0
+***************************************************************************************/
+template <class M> double LanguageModel::cal_increased_lm_score(const M &model, Cand* cand)
 {
-	RuleScore<Model> rule_score(*kenlm,cand->lm_state);
-	if ( cand->type == OOV || ( cand->type == NORMAL && cand->cands_of_nt_leaves.empty() ) )  // OOV候选或者由不含非终结符的规则生成的候选
+	RuleScore<M> rule_score(model,cand->lm_state);
+	double sub_estimate = 0.0;
+	if ( cand->type == OOV )                                                                  // OOV候选
 	{
-		for (const auto wid : cand->tgt_wids)
-		{
-			rule_score.Terminal( convert_to_kenlm_id(wid) );
-		}
+		rule_score.Terminal( convert_to_kenlm_id(cand->oov_wid) );
 	}
-	else if (cand->type == NORMAL)                                                            // 由含非终结符的规则生成的候选
+	else if (cand->type == NORMAL)                                                            // 由普通规则生成的候选
 	{
-		TgtRule &applied_rule = cand->matched_tgt_rules->at(cand->rule_rank);
+		const TgtRule &applied_rule = cand->matched_rule_group->rules()[cand->rule_rank];
 		size_t nt_idx = 0;
-		for (size_t i=0; i<applied_rule.aligned_src_positions.size(); i++)
+		for (int i=0; i<applied_rule.leaf_num; i++)
 		{
-			if (applied_rule.aligned_src_positions[i] == -1)
+			if (applied_rule.aligned_src_positions()[i] == -1)
 			{
-				rule_score.Terminal( convert_to_kenlm_id(applied_rule.tgt_leaves[i]) );
+				rule_score.Terminal( convert_to_kenlm_id(applied_rule.tgt_leaves()[i]) );
 			}
 			else
 			{
-				rule_score.NonTerminal(cand->cands_of_nt_leaves[nt_idx][cand->cand_rank_vec[nt_idx]]->lm_state);
+				const Cand *subcand = (*cand->cands_of_nt_leaves)[nt_idx][cand->cand_rank_vec[nt_idx]];
+				rule_score.NonTerminal(subcand->lm_state);
+				sub_estimate += subcand->lm_left_estimate;
 				nt_idx++;
 			}
 		}
 	}
 	else if (cand->type == GLUE)                                                              // glue候选
 	{
-		for (size_t nt_idx=0; nt_idx<cand->cands_of_nt_leaves.size(); nt_idx++)
+		for (size_t nt_idx=0; nt_idx<cand->cands_of_nt_leaves->size(); nt_idx++)
 		{
-			rule_score.NonTerminal(cand->cands_of_nt_leaves[nt_idx][cand->cand_rank_vec[nt_idx]]->lm_state);
+			const Cand *subcand = (*cand->cands_of_nt_leaves)[nt_idx][cand->cand_rank_vec[nt_idx]];
+			rule_score.NonTerminal(subcand->lm_state);
+			sub_estimate += subcand->lm_left_estimate;
 		}
 	}
 	double increased_lm_score = rule_score.Finish();
 	cand->lm_state.ZeroRemaining();
-	return increased_lm_score;
+	const lm::ngram::Left &left = cand->lm_state.left;
+	cand->lm_left_estimate = -model.UnRest(left.pointers,left.pointers+left.length,1);
+	return increased_lm_score - cand->lm_left_estimate + sub_estimate;
+}
+
+double LanguageModel::cal_final_increased_lm_score(Cand* cand)
+{
+	if (rest_kenlm != NULL)
+		return cal_final_increased_lm_score(*rest_kenlm,cand);
+	return cal_final_increased_lm_score(*kenlm,cand);
 }
 
-double LanguageModel::cal_final_increased_lm_score(Cand* cand) 
+// 加上句首句尾后的得分增量, 左边界词得到完整上文, 因此加回候选的左边界估计
+template <class M> double LanguageModel::cal_final_increased_lm_score(const M &model, Cand* cand)
 {
 	ChartState cstate;
-	RuleScore<Model> rule_score(*kenlm, cstate);
+	RuleScore<M> rule_score(model, cstate);
 	rule_score.BeginSentence();
 	rule_score.NonTerminal(cand->lm_state, 0.0f);
 	rule_score.Terminal(EOS);
-	return rule_score.Finish();
+	return rule_score.Finish() + cand->lm_left_estimate;
 }
@@ -4,19 +4,27 @@
 #include "lm/model.hh"
 #include "lm/left.hh"
 #include "lm/enumerate_vocab.hh"
+#include "lm/binary_format.hh"
 using namespace lm::ngram;
 
+// 带rest cost的模型(RestProbingModel)为左边界词打分时使用rest cost, 即该词在任意上文下的最大概率,
+// 这里把它换回概率, 使候选的lm_prob与不带rest cost的模型相同, 二者之差记为候选的左边界估计
 class LanguageModel
 {
 	public:
-		LanguageModel(const string &lm_file, Vocab *tgt_vocab);
+		LanguageModel(const string &lm_file, Vocab *tgt_vocab, bool use_rest_cost);
 		double cal_increased_lm_score(Cand* cand);
 		double cal_final_increased_lm_score(Cand* cand);
+		bool has_rest_cost() {return rest_kenlm != NULL;}
 
 	private:
+		template <class M> M* load_model(const string &lm_file, Vocab *tgt_vocab);
+		template <class M> double cal_increased_lm_score(const M &model, Cand* cand);
+		template <class M> double cal_final_increased_lm_score(const M &model, Cand* cand);
 			lm::WordIndex convert_to_kenlm_id(int wid);
 	private:
-		Model *kenlm;
+		ProbingModel *kenlm;                         // 不带rest cost的模型
+		RestProbingModel *rest_kenlm;                // 带rest cost的模型, 与kenlm只有一个不为NULL
 		vector<lm::WordIndex> ori_to_kenlm_id;
 		lm::WordIndex EOS;
 };
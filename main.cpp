@@ -1,141 +1,176 @@
 #include "translator.h"
+#include "config.h"
 
-void read_config(Filenames &fns,Parameter &para, Weight &weight, const string &config_file)
+void parse_args(int argc, char *argv[],Filenames &fns,Parameter &para, Weight &weight)
 {
-	ifstream fin;
-	fin.open(config_file.c_str());
-	if (!fin.is_open())
-	{
-		cerr<<"fail to open config file\n";
-		return;
-	}
-	string line;
-	while(getline(fin,line))
+	read_config(fns,para,weight,"config.ini");
+	for( int i=1; i<argc; i++ )
 	{
-		TrimLine(line);
-		if (line == "[input-file]")
-		{
-			getline(fin,line);
-			fns.input_file = line;
-		}
-		else if (line == "[output-file]")
-		{
-			getline(fin,line);
-			fns.output_file = line;
-		}
-		else if (line == "[nbest-file]")
-		{
-			getline(fin,line);
-			fns.nbest_file = line;
-		}
-		else if (line == "[src-vocab-file]")
-		{
-			getline(fin,line);
-			fns.src_vocab_file = line;
-		}
-		else if (line == "[tgt-vocab-file]")
-		{
-			getline(fin,line);
-			fns.tgt_vocab_file = line;
-		}
-		else if (line == "[rule-table-file]")
-		{
-			getline(fin,line);
-			fns.rule_table_file = line;
-		}
-		else if (line == "[lm-file]")
-		{
-			getline(fin,line);
-			fns.lm_file = line;
-		}
-		else if (line == "[BEAM-SIZE]")
-		{
-			getline(fin,line);
-			para.BEAM_SIZE = stoi(line);
-		}
-		else if (line == "[SEN-THREAD-NUM]")
-		{
-			getline(fin,line);
-			para.SEN_THREAD_NUM = stoi(line);
-		}
-		else if (line == "[SPAN-THREAD-NUM]")
-		{
-			getline(fin,line);
-			para.SPAN_THREAD_NUM = stoi(line);
-		}
-		else if (line == "[NBEST-NUM]")
+		string arg( argv[i] );
+		if( arg == "-n-best-list" )
 		{
-			getline(fin,line);
-			para.NBEST_NUM = stoi(line);
+			fns.nbest_file = argv[++i];
+			para.NBEST_NUM = stoi(argv[++i]);
 		}
-		else if (line == "[RULE-NUM-LIMIT]")
+		else if( arg == "-compile-rule-table" )
 		{
-			getline(fin,line);
-			para.RULE_NUM_LIMIT = stoi(line);
+			fns.compiled_rule_table_file = argv[++i];
 		}
-		else if (line == "[PRINT-NBEST]")
+		else if( arg == "-rescore-rule-table" )
 		{
-			getline(fin,line);
-			para.PRINT_NBEST = stoi(line);
+			para.RESCORE_RULE_TABLE = true;
 		}
-		else if (line == "[DUMP-RULE]")
+		else if( arg == "-dump-forest" )
 		{
-			getline(fin,line);
-			para.DUMP_RULE = stoi(line);
+			fns.forest_file = argv[++i];
 		}
-		else if (line == "[LOAD-ALIGNMENT]")
+		else if( arg == "-rescore-forest" )
 		{
-			getline(fin,line);
-			para.LOAD_ALIGNMENT = stoi(line);
+			fns.rescore_forest_file = argv[++i];
 		}
-		else if (line == "[weight]")
+
+	}
+}
+
+void write_nbest_file(const vector<vector<TuneInfo> > &nbest_tune_info_list)
+{
+	ofstream fnbest("nbest.txt");
+	if (!fnbest.is_open())
+	{
+		cerr<<"cannot open nbest file!\n";
+		return;
+	}
+	for (const auto &nbest_tune_info : nbest_tune_info_list)
+	{
+		for (const auto &tune_info : nbest_tune_info)
 		{
-			while(getline(fin,line))
+			fnbest<<tune_info.sen_id<<" ||| "<<tune_info.translation<<" ||| ";
+			for (const auto &v : tune_info.feature_values)
 			{
-				if (line == "")
-					break;
-				stringstream ss(line);
-				string feature;
-				ss >> feature;
-				if (feature.find("trans") != string::npos)
-				{
-					double w;
-					ss>>w;
-					weight.trans.push_back(w);
-				}
-				else if(feature == "len")
-				{
-					ss>>weight.len;
-				}
-				else if(feature == "lm")
-				{
-					ss>>weight.lm;
-				}
-				else if(feature == "rule-num")
-				{
-					ss>>weight.rule_num;
-				}
+				fnbest<<v<<' ';
 			}
+			fnbest<<"||| "<<tune_info.total_score<<endl;
 		}
 	}
 }
 
-void parse_args(int argc, char *argv[],Filenames &fns,Parameter &para, Weight &weight)
+/**************************************************************************************
+ 1. 函数功能: 用新的特征权重对解码时保存的翻译森林重新打分, 输出译文和n-best列表
+ 2. 入口参数: 参数, 新的特征权重, 森林文件, 译文输出文件
+ 3. 出口参数: 无
+ 4. 算法简介: 逐句读取森林, 重新计算超边得分后惰性抽取k-best推导, 不需要加载规则表和语言模型
+***************************************************************************************/
+void rescore_forest_file(const Parameter &para, const Weight &weight, const string &forest_file, const string &output_file)
 {
-	read_config(fns,para,weight,"config.ini");
-	for( int i=1; i<argc; i++ )
+	ForestReader forest_reader(forest_file);
+	if (!forest_reader.is_open())
+		return;
+	if ((size_t)forest_reader.get_feature_num() != weight.trans.size()+3)
 	{
-		string arg( argv[i] );
-		if( arg == "-n-best-list" )
+		cerr<<"feature number of forest file does not match the weights!\n";
+		return;
+	}
+	ofstream fout(output_file.c_str());
+	if (!fout.is_open())
+	{
+		cerr<<"cannot open output file!\n";
+		return;
+	}
+	vector<vector<TuneInfo> > nbest_tune_info_list;
+	Forest forest;
+	while (forest_reader.read_forest(forest))
+	{
+		rescore_forest(forest,weight);
+		ForestKbest forest_kbest(forest);
+		const ForestDerivation *best = forest_kbest.get_kth_best(0);
+		fout<<(best == NULL ? "" : forest_kbest.get_translation(best,true))<<endl;
+		if (para.PRINT_NBEST == false)
+			continue;
+		vector<TuneInfo> nbest_tune_info;
+		for (size_t i=0;i<para.NBEST_NUM;i++)
 		{
-			fns.nbest_file = argv[++i];
-			para.NBEST_NUM = stoi(argv[++i]);
+			const ForestDerivation *d = forest_kbest.get_kth_best(i);
+			if (d == NULL)
+				break;
+			TuneInfo tune_info;
+			tune_info.sen_id = forest.sen_id;
+			tune_info.translation = forest_kbest.get_translation(d,false);
+			tune_info.feature_values = d->features;
+			tune_info.total_score = d->score;
+			nbest_tune_info.push_back(tune_info);
 		}
+		nbest_tune_info_list.push_back(nbest_tune_info);
+	}
+	if (para.PRINT_NBEST == true)
+	{
+		write_nbest_file(nbest_tune_info_list);
+	}
+}
+
+// 翻译文件时所有句子共享的输入, 输出和调度状态
+struct FileTranslation
+{
+	const Models *models;
+	const Parameter *para;
+	const Weight *weight;
+	bool dump_forest;
+	vector<string> input_sen;
+	vector<string> output_sen;
+	vector<vector<TuneInfo> > nbest_tune_info_list;
+	vector<vector<string> > applied_rules_list;
+	vector<Forest> forests;
+	vector<int> is_degraded;                                // 不用vector<bool>, 多个线程同时写不同的元素
+	size_t pruned_cand_num;
+	int next_sen;                                           // 下一个要开始翻译的句子
+};
+
+void start_next_sentence(FileTranslation *ft);
 
+// 句子翻译完成后在完成它的线程中调用: 收集结果, 释放句子占用的内存, 然后开始翻译下一个句子
+void finish_sentence(FileTranslation *ft, SentenceTranslator *sen_translator, int i)
+{
+	ft->output_sen.at(i) = sen_translator->get_translation();
+	if (ft->para->PRINT_NBEST == true)
+	{
+		ft->nbest_tune_info_list.at(i) = sen_translator->get_tune_info(i);
+	}
+	if (ft->para->DUMP_RULE == true)
+	{
+		ft->applied_rules_list.at(i) = sen_translator->get_applied_rules(i);
 	}
+	if (ft->dump_forest)
+	{
+		sen_translator->get_forest(i,ft->forests.at(i));
+	}
+#pragma omp atomic
+	ft->pruned_cand_num += sen_translator->get_pruned_cand_num();
+	ft->is_degraded.at(i) = sen_translator->is_degraded();
+	delete sen_translator;
+#pragma omp task firstprivate(ft)
+	start_next_sentence(ft);
+}
+
+// 取下一个句子开始翻译, 不等待它翻译结束
+void start_next_sentence(FileTranslation *ft)
+{
+	int i;
+#pragma omp atomic capture
+	i = ft->next_sen++;
+	if (i >= (int)ft->input_sen.size())
+		return;
+	SentenceTranslator *sen_translator = new SentenceTranslator(*ft->models,*ft->para,*ft->weight,ft->input_sen.at(i));
+	sen_translator->translate_sentence([ft,sen_translator,i](){finish_sentence(ft,sen_translator,i);});
 }
 
-void translate_file(const Models &models, const Parameter &para, const Weight &weight, const string &input_file, const string &output_file)
+/**************************************************************************************
+ 1. 函数功能: 翻译输入文件中的所有句子, 输出译文, n-best列表, 使用的规则和翻译森林
+ 2. 入口参数: 模型, 参数, 特征权重, 输入文件, 输出文件, 森林文件(为空则不输出)
+ 3. 出口参数: 无
+ 4. 算法简介: 所有句子的节点任务都在一个THREAD_NUM个线程的线程池中执行; 开始时启动THREAD_NUM个
+              句子, 每个句子翻译完成后再启动下一个, 因此同时翻译的句子数(以及内存占用)有上限;
+              句子任务只创建节点任务而不等待它们, 空闲线程可以执行任何句子的节点任务
+***************************************************************************************/
+void translate_file(const Models &models, const Parameter &para, const Weight &weight, const string &input_file, const string &output_file, const string &forest_file)
 {
 	ifstream fin(input_file.c_str());
 	if (!fin.is_open())
@@ -149,57 +184,73 @@ void translate_file(const Models &models, const Parameter &para, const Weight &w
 		cerr<<"cannot open output file!\n";
 		return;
 	}
-	vector<string> input_sen;
-	vector<string> output_sen;
-	vector<vector<TuneInfo> > nbest_tune_info_list;
-	vector<vector<string> > applied_rules_list;
+	FileTranslation ft;
+	ft.models = &models;
+	ft.para = &para;
+	ft.weight = &weight;
+	ft.dump_forest = !forest_file.empty();
 	string line;
 	while(getline(fin,line))
 	{
 		TrimLine(line);
-		input_sen.push_back(line);
-	}
-	int sen_num = input_sen.size();
-	output_sen.resize(sen_num);
-	nbest_tune_info_list.resize(sen_num);
-	applied_rules_list.resize(sen_num);
-#pragma omp parallel for num_threads(para.SEN_THREAD_NUM)
-	for (size_t i=0;i<sen_num;i++)
-	{
-		SentenceTranslator sen_translator(models,para,weight,input_sen.at(i));
-		output_sen.at(i) = sen_translator.translate_sentence();
-		if (para.PRINT_NBEST == true)
+		ft.input_sen.push_back(line);
+	}
+	size_t sen_num = ft.input_sen.size();
+	ft.output_sen.resize(sen_num);
+	ft.nbest_tune_info_list.resize(sen_num);
+	ft.applied_rules_list.resize(sen_num);
+	if (ft.dump_forest)
+	{
+		ft.forests.resize(sen_num);
+	}
+	ft.is_degraded.resize(sen_num,0);
+	ft.pruned_cand_num = 0;
+	ft.next_sen = 0;
+	int thread_num = para.THREAD_NUM;
+#pragma omp parallel num_threads(thread_num)
+	{
+#pragma omp single
 		{
-			nbest_tune_info_list.at(i) = sen_translator.get_tune_info(i);
+			for (int k=0;k<thread_num;k++)
+			{
+#pragma omp task
+				start_next_sentence(&ft);
+			}
 		}
-		if (para.DUMP_RULE == true)
+	}
+	if (para.BEAM_THRESHOLD > 0)
+	{
+		cout<<"candidates pruned by beam threshold: "<<ft.pruned_cand_num<<endl;
+	}
+	if (para.SEN_TIME_BUDGET > 0)
+	{
+		size_t degraded_sen_num = 0;
+		for (size_t i=0;i<sen_num;i++)
 		{
-			applied_rules_list.at(i) = sen_translator.get_applied_rules(i);
+			if (ft.is_degraded[i] != 0)
+			{
+				cerr<<"sentence "<<i<<" exceeded the time budget, search space was reduced\n";
+				degraded_sen_num++;
+			}
 		}
+		cout<<"sentences decoded with reduced search space: "<<degraded_sen_num<<endl;
 	}
-	for (const auto &sen : output_sen)
+	for (const auto &sen : ft.output_sen)
 	{
 		fout<<sen<<endl;
 	}
 	if (para.PRINT_NBEST == true)
 	{
-		ofstream fnbest("nbest.txt");
-		if (!fnbest.is_open())
-		{
-			cerr<<"cannot open nbest file!\n";
+		write_nbest_file(ft.nbest_tune_info_list);
+	}
+	if (!forest_file.empty())
+	{
+		ForestWriter forest_writer(forest_file,PROB_NUM+3);
+		if (!forest_writer.is_open())
 			return;
-		}
-		for (const auto &nbest_tune_info : nbest_tune_info_list)
+		for (const auto &forest : ft.forests)
 		{
-			for (const auto &tune_info : nbest_tune_info)
-			{
-				fnbest<<tune_info.sen_id<<" ||| "<<tune_info.translation<<" ||| ";
-				for (const auto &v : tune_info.feature_values)
-				{
-					fnbest<<v<<' ';
-				}
-				fnbest<<"||| "<<tune_info.total_score<<endl;
-			}
+			forest_writer.write_forest(forest);
 		}
 	}
 	if (para.DUMP_RULE == true)
@@ -211,7 +262,7 @@ void translate_file(const Models &models, const Parameter &para, const Weight &w
 			return;
 		}
 		size_t n=0;
-		for (const auto &applied_rules : applied_rules_list)
+		for (const auto &applied_rules : ft.applied_rules_list)
 		{
 			frules<<++n<<endl;
 			for (const auto &applied_rule : applied_rules)
@@ -227,22 +278,53 @@ int main( int argc, char *argv[])
 	clock_t a,b;
 	a = clock();
 
-	omp_set_nested(1);
 	Filenames fns;
 	Parameter para;
 	Weight weight;
 	parse_args(argc,argv,fns,para,weight);
+	if (!fns.rescore_forest_file.empty())
+	{
+		rescore_forest_file(para,weight,fns.rescore_forest_file,fns.output_file);
+		b = clock();
+		cout<<"time cost: "<<double(b-a)/CLOCKS_PER_SEC<<endl;
+		return 0;
+	}
 
 	Vocab *src_vocab = new Vocab(fns.src_vocab_file);
 	Vocab *tgt_vocab = new Vocab(fns.tgt_vocab_file);
-	RuleTable *ruletable = new RuleTable(para.RULE_NUM_LIMIT,para.LOAD_ALIGNMENT,weight,fns.rule_table_file,src_vocab,tgt_vocab);
-	LanguageModel *lm_model = new LanguageModel(fns.lm_file,tgt_vocab);
+	bool is_compiling = !fns.compiled_rule_table_file.empty();
+	size_t rule_cache_size = is_compiling ? 0 : para.RULE_CACHE_SIZE;   // 编译时需要完整的规则表
+	RuleTable *ruletable = new RuleTable(para.RULE_NUM_LIMIT,para.LOAD_ALIGNMENT,para.LOAD_THREAD_NUM,rule_cache_size,para.PROB_BITS,weight,fns.rule_table_file,src_vocab,tgt_vocab);
+	if (ruletable->has_stale_scores())
+	{
+		// 重新打分会使规则表变为进程私有的副本, 只在显式要求时进行;
+		// 编译时则用当前权重重新打分后写出新的规则表
+		if (!is_compiling && !para.RESCORE_RULE_TABLE)
+		{
+			cerr<<"trans weights differ from those of the compiled rule table, recompile it with -compile-rule-table or run with -rescore-rule-table\n";
+			return 1;
+		}
+		ruletable->rescore(weight);
+	}
+	if (is_compiling)
+	{
+		ruletable->save_compiled_rule_table(fns.compiled_rule_table_file);
+		return 0;
+	}
+	LanguageModel *lm_model = new LanguageModel(fns.lm_file,tgt_vocab,para.LM_LEFT_ESTIMATE);
+	LanguageModel *coarse_lm_model = NULL;
+	if (!fns.coarse_lm_file.empty())
+	{
+		coarse_lm_model = new LanguageModel(fns.coarse_lm_file,tgt_vocab,para.LM_LEFT_ESTIMATE);
+	}
+	tgt_vocab->freeze();                                        // 之后单词表只读, 各线程共享
 
 	b = clock();
 	cout<<"loading time: "<<double(b-a)/CLOCKS_PER_SEC<<endl;
 
-	Models models = {src_vocab,tgt_vocab,ruletable,lm_model};
-	translate_file(models,para,weight,fns.input_file,fns.output_file);
+	Models models = {src_vocab,tgt_vocab,ruletable,lm_model,coarse_lm_model};
+	translate_file(models,para,weight,fns.input_file,fns.output_file,fns.forest_file);
+	ruletable->print_cache_info();
 	b = clock();
 	cout<<"time cost: "<<double(b-a)/CLOCKS_PER_SEC<<endl;
 	return 0;
@@ -13,7 +13,7 @@ vector<string> Split(const string &s)
 vector<string> Split(const string &s, const string &sep)
 {
 	vector <string> vs;
-	int cur = 0,next;
+	size_t cur = 0,next;
 	next = s.find(sep);
 	while(next != string::npos)
 	{
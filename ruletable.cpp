@@ -1,48 +1,232 @@
 #include "ruletable.h"
+#include "syntaxtree.h"
+#include <sys/mman.h>
 
-void RuleTrieNode::group_and_sort_tgt_rules()
+/**************************************************************************************
+ 1. 函数功能: 对规则分组并在组内按得分从高到低排序, 分组中只记录规则的序号, 规则本身不复制
+ 2. 入口参数: 无
+ 3. 出口参数: 无
+ 4. 算法简介: a) 加载时tgt_rules是一个堆, 先按规则在rule.bin中的顺序恢复, 使结果与加载线程数无关
+              b) 按目标端非终结符及其对齐分组, 组内按得分排序
+              c) 将所有分组依次连接后按得分排序, 得到每条规则在当前规则源端中的排名,
+                 同一组内的排名是递增的, 解码时可以据此截断每组规则
+              两次排序和加载时的堆都在得分相同时按load_order排序, 因此排名是确定的
+***************************************************************************************/
+void RawTrieNode::group_and_sort_tgt_rules()
 {
-	for (auto &tgt_rule : tgt_rules)
+	sort( tgt_rules.begin(), tgt_rules.end(), [](const RawTgtRule &a, const RawTgtRule &b){return a.load_order < b.load_order;} );
+	for (size_t rule_idx=0; rule_idx<tgt_rules.size(); rule_idx++)
 	{
+		const RawTgtRule &tgt_rule = tgt_rules[rule_idx];
+		vector<int> group_id;
 		for (size_t i=0; i<tgt_rule.aligned_src_positions.size(); i++)        // 遍历规则目标端叶节点
 		{
 			if (tgt_rule.aligned_src_positions[i] == -1)                      // 跳过词汇节点
 				continue;
-			tgt_rule.group_id.push_back(tgt_rule.tgt_leaves[i]);              // 非终结符
-			tgt_rule.group_id.push_back(tgt_rule.aligned_src_positions[i]);   // 非终结符在源端句法树片段叶节点中对应的位置
-		}
-
-		auto it = tgt_rule_group.find(tgt_rule.group_id);
-		if ( it == tgt_rule_group.end() )
-		{
-			vector<TgtRule> tgt_rules = {tgt_rule};
-			tgt_rule_group.insert( make_pair(tgt_rule.group_id,tgt_rules) );
-		}
-		else
-		{
-			it->second.push_back(tgt_rule);
+			group_id.push_back(tgt_rule.tgt_leaves[i]);                       // 非终结符
+			group_id.push_back(tgt_rule.aligned_src_positions[i]);            // 非终结符在源端句法树片段叶节点中对应的位置
 		}
+		tgt_rule_group[group_id].push_back(rule_idx);
 	}
 
+	auto is_better = [this](int a, int b){return tgt_rules[a].is_better_than(tgt_rules[b]);};    // 得分相同时按加载顺序, 与加载时的堆一致
 	for (auto &kvp : tgt_rule_group)
 	{
-		sort( kvp.second.begin(), kvp.second.end() );
-		reverse( kvp.second.begin(), kvp.second.end() );
+		sort( kvp.second.begin(), kvp.second.end(), is_better );
+	}
+
+	vector<int> rule_idx_by_score;
+	for (const auto &kvp : tgt_rule_group)
+	{
+		rule_idx_by_score.insert(rule_idx_by_score.end(),kvp.second.begin(),kvp.second.end());
+	}
+	sort( rule_idx_by_score.begin(), rule_idx_by_score.end(), is_better );
+	for (size_t rank=0; rank<rule_idx_by_score.size(); rank++)
+	{
+		tgt_rules[rule_idx_by_score[rank]].node_rank = rank;
 	}
 }
 
-RuleTable::RuleTable(const size_t size_limit,bool load_alignment,const Weight &i_weight,const string &rule_table_file,Vocab *i_src_vocab, Vocab* i_tgt_vocab)
+RuleTable::RuleTable(const size_t size_limit,bool load_alignment,const size_t load_thread_num,const size_t rule_cache_size,const size_t prob_bits,const Weight &i_weight,const string &rule_table_file,Vocab *i_src_vocab, Vocab* i_tgt_vocab)
 {
 	src_vocab = i_src_vocab;
 	tgt_vocab = i_tgt_vocab;
 	RULE_NUM_LIMIT=size_limit;
+	LOAD_THREAD_NUM=load_thread_num;
+	RULE_CACHE_SIZE=rule_cache_size;
+	PROB_BITS=prob_bits;
+	if (PROB_BITS != 0 && PROB_BITS != 8 && PROB_BITS != 16)
+	{
+		cerr<<"PROB-BITS must be 0, 8 or 16!\n";
+		exit(1);
+	}
 	LOAD_ALIGNMENT = load_alignment;
 	weight=i_weight;
-	root=new RuleTrieNode;
-	load_rule_table(rule_table_file);
-	group_rules_for_subtrie(root);
+	rule_cache = NULL;
+	is_table_writable = true;
+	need_rescore_block = false;
+	is_score_stale = false;
+	if (is_compiled_rule_table(rule_table_file))
+	{
+		load_compiled_rule_table(rule_table_file);
+	}
+	else
+	{
+		if (RULE_CACHE_SIZE != 0)
+		{
+			cerr<<"warning: RULE-CACHE-SIZE only works with compiled rule table, load the whole rule table instead\n";
+		}
+		raw_root=new RawTrieNode;
+		raw_root->rule_level_id = -1;
+		load_rule_table(rule_table_file);
+		compile_trie();
+		delete raw_root;
+		raw_root = NULL;
+	}
+}
+
+template <class T> inline T read_value(const char *&p)
+{
+	T value;
+	memcpy(&value,p,sizeof(T));
+	p += sizeof(T);
+	return value;
+}
+
+template <class T> inline void read_array(const char *&p, T *to, size_t num)
+{
+	memcpy(to,p,sizeof(T)*num);
+	p += sizeof(T)*num;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 计算rule.bin中一条规则所占的字节数, 只读取长度字段
+ 2. 入口参数: 规则的起始位置, 文件末尾
+ 3. 出口参数: 规则所占的字节数, 规则不完整时返回0
+***************************************************************************************/
+size_t RuleTable::get_rule_size(const char *p, const char *end)
+{
+	const char *beg = p;
+	if (end-p < (long)sizeof(short int))
+		return 0;
+	short int src_rule_len = read_value<short int>(p);
+	p += sizeof(int)*src_rule_len + sizeof(int);
+	if (end-p < (long)sizeof(short int))
+		return 0;
+	short int tgt_rule_len = read_value<short int>(p);
+	p += sizeof(int)*tgt_rule_len*2 + sizeof(double)*PROB_NUM + sizeof(short int)*2;
+	if (LOAD_ALIGNMENT == true)
+	{
+		if (end-p < (long)sizeof(short int))
+			return 0;
+		short int alignment_num = read_value<short int>(p);
+		p += sizeof(int)*alignment_num;
+	}
+	if (p > end)
+		return 0;
+	return p-beg;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 解析rule.bin中的一条规则
+ 2. 入口参数: 规则的起始位置
+ 3. 出口参数: 规则源端节点的id序列, 规则目标端
+***************************************************************************************/
+void RuleTable::parse_rule(const char *p, vector<int> &rulenode_ids, RawTgtRule &tgt_rule)
+{
+	// 读取规则源端节点的id序列, 规则源端节点为规则源端句法树片段的一层, 存储为规则Trie树中的一个节点
+	short int src_rule_len = read_value<short int>(p);
+	rulenode_ids.resize(src_rule_len);
+	read_array(p,rulenode_ids.data(),src_rule_len);
+
+	//树到树的规则使用, 临时用一下
+	tgt_rule.tgt_root = read_value<int>(p);
+
+	// 读取规则目标端的叶节点序列以及非终结符的对齐
+	short int tgt_rule_len = read_value<short int>(p);
+	tgt_rule.tgt_leaves.resize(tgt_rule_len);
+	read_array(p,tgt_rule.tgt_leaves.data(),tgt_rule_len);
+	tgt_rule.aligned_src_positions.resize(tgt_rule_len);
+	read_array(p,tgt_rule.aligned_src_positions.data(),tgt_rule_len);
+
+	// 规则目标端的词汇个数
+	tgt_rule.word_num = 0;
+	for (const auto pos : tgt_rule.aligned_src_positions)
+	{
+		if (pos == -1)
+			tgt_rule.word_num++;
+	}
+
+	// 规则的6个翻译概率
+	tgt_rule.probs.resize(PROB_NUM);
+	read_array(p,tgt_rule.probs.data(),PROB_NUM);
+
+	// 规则类型
+	tgt_rule.is_composed_rule = read_value<short int>(p);
+	tgt_rule.is_lexical_rule  = read_value<short int>(p);
+
+	if (false)
+	{
+		for (auto id : rulenode_ids)
+		{
+			cout<<src_vocab->get_word(id)<<endl;
+		}
+		cout<<"@@@"<<endl;
+		cout<<tgt_vocab->get_word(tgt_rule.tgt_root)<<endl;
+		for (auto id : tgt_rule.tgt_leaves)
+		{
+			cout<<tgt_vocab->get_word(id)<<' ';
+		}
+		for (auto pos : tgt_rule.aligned_src_positions)
+		{
+			cout<<pos<<' ';
+		}
+		cout<<endl;
+		for (auto prob : tgt_rule.probs)
+		{
+			cout<<prob<<' ';
+		}
+		cout<<endl;
+		cout<<tgt_rule.is_composed_rule<<' '<<tgt_rule.is_lexical_rule<<' '<<endl<<endl<<endl;
+	}
+
+	if (LOAD_ALIGNMENT == true)
+	{
+		short int alignment_num = read_value<short int>(p);
+		vector<pair<int,int> > align_pairs(alignment_num/2);
+		for(int i=0;i<alignment_num/2;i++)
+		{
+			align_pairs[i].first  = read_value<int>(p);
+			align_pairs[i].second = read_value<int>(p);
+		}
+		stable_sort(align_pairs.begin(),align_pairs.end(),[](const pair<int,int> &a, const pair<int,int> &b){return a.first < b.first;});
+		for (const auto &align_pair : align_pairs)
+		{
+			tgt_rule.alignment.push_back(align_pair.first);
+			tgt_rule.alignment.push_back(align_pair.second);
+		}
+	}
+
+	tgt_rule.score = 0;
+	if( tgt_rule.probs.size() != weight.trans.size() )
+	{
+		cout<<"number of probability in rule is wrong!"<<endl;
+	}
+	for( size_t i=0; i<weight.trans.size(); i++ )
+	{
+		tgt_rule.score += tgt_rule.probs[i]*weight.trans[i];
+	}
 }
 
+/**************************************************************************************
+ 1. 函数功能: 多线程加载rule.bin, 结果与按文件顺序逐条加载完全相同
+ 2. 入口参数: rule.bin文件名
+ 3. 出口参数: 无
+ 4. 算法简介: a) 将整个文件映射到内存, 顺序扫描长度字段切分出每条规则
+              b) 按规则源端的根节点标签对规则分块, 块内保持文件中的顺序
+              c) 每个线程负责若干个根节点标签, 并行解析规则, 构建子树, 并对子树中的规则分组排序
+              由于不同子树互不相交, 且每个Trie节点的规则插入顺序不变, 因此结果与串行加载相同
+***************************************************************************************/
 void RuleTable::load_rule_table(const string &rule_table_file)
 {
 	ifstream fin(rule_table_file.c_str(),ios::binary);
@@ -51,140 +235,878 @@ void RuleTable::load_rule_table(const string &rule_table_file)
 		cerr<<"cannot open rule table file!\n";
 		return;
 	}
-	short int src_rule_len=0;
-	while(fin.read((char*)&src_rule_len,sizeof(short int)))
+	fin.close();
+	util::scoped_fd fd(util::OpenReadOrThrow(rule_table_file.c_str()));
+	uint64_t file_size = util::SizeOrThrow(fd.get());
+	if (file_size == 0)
+		return;
+	util::scoped_memory file_memory;
+	util::MapRead(util::POPULATE_OR_READ,fd.get(),0,file_size,file_memory);
+
+	vector<const char*> root_rules;                                   // 源端为空的规则, 直接挂在根节点上
+	map<int,vector<const char*> > rules_of_root_label;
+	const char *p = file_memory.begin(), *end = file_memory.end();
+	while (p < end)
 	{
-		// 读取规则源端节点的id序列, 规则源端节点为规则源端句法树片段的一层, 存储为规则Trie树中的一个节点
-		vector<int> rulenode_ids;
-		rulenode_ids.resize(src_rule_len);
-		fin.read((char*)&rulenode_ids[0],sizeof(int)*src_rule_len);
+		size_t rule_size = get_rule_size(p,end);
+		if (rule_size == 0)
+			break;
+		short int src_rule_len;
+		memcpy(&src_rule_len,p,sizeof(short int));
+		if (src_rule_len == 0)
+		{
+			root_rules.push_back(p);
+		}
+		else
+		{
+			int root_label;
+			memcpy(&root_label,p+sizeof(short int),sizeof(int));
+			rules_of_root_label[root_label].push_back(p);
+		}
+		p += rule_size;
+	}
 
-		TgtRule tgt_rule;
-		//树到树的规则使用, 临时用一下
-		fin.read((char*)&tgt_rule.tgt_root,sizeof(int));
+	vector<vector<const char*>*> rule_blocks;
+	vector<RawTrieNode*> subtrie_roots;
+	for (auto &kvp : rules_of_root_label)
+	{
+		RawTrieNode* subtrie_root = new RawTrieNode();                 // 先串行建好根节点的子节点, 之后各线程只读根节点
+		subtrie_root->father = raw_root;
+		subtrie_root->rule_level_id = kvp.first;
+		raw_root->subtrie_map.insert(make_pair(kvp.first,subtrie_root));
+		rule_blocks.push_back(&kvp.second);
+		subtrie_roots.push_back(subtrie_root);
+	}
+	vector<int> rulenode_ids;
+	for (const auto rule_ptr : root_rules)
+	{
+		RawTgtRule tgt_rule;
+		parse_rule(rule_ptr,rulenode_ids,tgt_rule);
+		add_rule_to_trie(rulenode_ids,tgt_rule);
+	}
+	raw_root->group_and_sort_tgt_rules();
 
-		// 读取规则目标端的叶节点序列以及非终结符的对齐
-		short int tgt_rule_len;
-		fin.read((char*)&tgt_rule_len,sizeof(short int));
-		tgt_rule.tgt_leaves.resize(tgt_rule_len);
-		fin.read((char*)&(tgt_rule.tgt_leaves[0]),sizeof(int)*tgt_rule_len);
-		tgt_rule.aligned_src_positions.resize(tgt_rule_len);
-		fin.read((char*)&(tgt_rule.aligned_src_positions[0]),sizeof(int)*tgt_rule_len);
-		
-		// 规则目标端的词汇个数
-		tgt_rule.word_num = 0;
-		for (const auto pos : tgt_rule.aligned_src_positions)
+#pragma omp parallel for schedule(dynamic) num_threads(LOAD_THREAD_NUM)
+	for (size_t i=0; i<rule_blocks.size(); i++)
+	{
+		vector<int> rulenode_ids;
+		for (const auto rule_ptr : *rule_blocks[i])
 		{
-			if (pos == -1)
-				tgt_rule.word_num++;
+			RawTgtRule tgt_rule;
+			parse_rule(rule_ptr,rulenode_ids,tgt_rule);
+			add_rule_to_trie(rulenode_ids,tgt_rule);
 		}
+		group_rules_for_subtrie(subtrie_roots[i]);
+	}
+	cout<<"load rule table file "<<rule_table_file<<" over\n";
+}
 
-		// 规则的6个翻译概率
-		tgt_rule.probs.resize(PROB_NUM);
-		fin.read((char*)&(tgt_rule.probs[0]),sizeof(double)*PROB_NUM);
+/**************************************************************************************
+ 1. 函数功能: 将一条规则加入规则Trie树
+ 2. 入口参数: 规则源端节点的id序列, 规则目标端
+ 3. 出口参数: 无
+ 4. 算法简介: 每个Trie节点的目标端组成以最差规则为堆顶的堆, 不超过RULE_NUM_LIMIT时直接入堆,
+              否则只有比堆顶好的规则才替换堆顶, 每条规则的代价为O(log RULE_NUM_LIMIT)
+***************************************************************************************/
+void RuleTable::add_rule_to_trie(const vector<int> &rulenode_ids, RawTgtRule &tgt_rule)
+{
+	RawTrieNode* current = raw_root;
+	for (const auto &node_id : rulenode_ids)
+	{        
+		auto it = current->subtrie_map.find(node_id);
+		if ( it != current->subtrie_map.end() )
+		{
+			current = it->second;
+		}
+		else
+		{
+			RawTrieNode* tmp = new RawTrieNode();
+			tmp->father = current;
+			tmp->rule_level_id = node_id;
+			current->subtrie_map.insert(make_pair(node_id,tmp));
+			current = tmp;
+		}
+	}
+	auto is_better = [](const RawTgtRule &a, const RawTgtRule &b){return a.is_better_than(b);};
+	vector<RawTgtRule> &heap = current->tgt_rules;
+	tgt_rule.load_order = current->loaded_rule_num++;
+	if (heap.size() < (size_t)RULE_NUM_LIMIT)
+	{
+		heap.push_back(move(tgt_rule));
+		push_heap(heap.begin(),heap.end(),is_better);
+	}
+	else if ( !heap.empty() && tgt_rule.is_better_than(heap.front()) )
+	{
+		pop_heap(heap.begin(),heap.end(),is_better);
+		heap.back() = move(tgt_rule);
+		push_heap(heap.begin(),heap.end(),is_better);
+	}
+}
 
-		// 规则类型
-		fin.read((char*)&tgt_rule.is_composed_rule,sizeof(short int));
-		fin.read((char*)&tgt_rule.is_lexical_rule,sizeof(short int));
+void RuleTable::group_rules_for_subtrie(RawTrieNode *node)
+{
+	node->group_and_sort_tgt_rules();
+	for (auto &kvp : node->subtrie_map)
+	{
+		group_rules_for_subtrie(kvp.second);
+	}
+}
+
+static const char RULE_TABLE_MAGIC[8] = {'T','2','T','R','U','L','E','S'};
+static const uint32_t RULE_TABLE_VERSION = 6;
+
+inline int64_t offset_between(const void *from, const void *to)
+{
+	return reinterpret_cast<const char*>(to) - reinterpret_cast<const char*>(from);
+}
 
-		if (false)
+inline size_t align8(size_t size)
+{
+	return (size+7)/8*8;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 将源端句法树的一层预先解析成整数序列
+ 2. 入口参数: 源端句法树一层的字符串, 是否为根节点的下一层, 标签到id的映射
+ 3. 出口参数: 解析后的整数序列
+ 4. 算法简介: a) 根节点的下一层即句法片段的根节点, 整体作为一个标签
+              b) 其他层按"|||"切分成每个叶节点的扩展, "~"表示该叶节点不扩展, 记为-1;
+                 否则记为扩展出的节点数, 后跟每个节点的标签id
+***************************************************************************************/
+vector<int> RuleTable::compile_pattern(const string &rule_level_str, bool is_root_level, const map<string,int> &label2id)
+{
+	if (is_root_level)
+		return {label2id.at(rule_level_str)};
+	vector<int> pattern;
+	for (const auto &leaf_str : Split(rule_level_str,"|||"))
+	{
+		if (leaf_str == "~")
 		{
-			for (auto id : rulenode_ids)
-			{
-				cout<<src_vocab->get_word(id)<<endl;
-			}
-			cout<<"@@@"<<endl;
-			cout<<tgt_vocab->get_word(tgt_rule.tgt_root)<<endl;
-			for (auto id : tgt_rule.tgt_leaves)
+			pattern.push_back(-1);
+			continue;
+		}
+		vector<string> labels = Split(leaf_str);
+		pattern.push_back(labels.size());
+		for (const auto &label : labels)
+		{
+			pattern.push_back(label2id.at(label));
+		}
+	}
+	return pattern;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 为每个翻译概率生成量化码本
+ 2. 入口参数: 规则Trie树的所有节点
+ 3. 出口参数: PROB_NUM个码本, 每个有(1<<PROB_BITS)个从小到大排列的值
+ 4. 算法简介: 与lm/quantize.cc相同, 将每列概率排序后分成样本数相等的若干区间, 取区间均值;
+              不同的值不超过区间个数时直接用这些值作码本, 量化无损
+***************************************************************************************/
+void RuleTable::make_prob_codebook(const vector<RawTrieNode*> &raw_nodes, double *centers)
+{
+	size_t bin_num = 1<<PROB_BITS;
+	for (size_t j=0; j<PROB_NUM; j++, centers+=bin_num)
+	{
+		vector<double> values;
+		for (const auto raw_node : raw_nodes)
+		{
+			for (const auto &raw_rule : raw_node->tgt_rules)
 			{
-				cout<<tgt_vocab->get_word(id)<<' ';
+				values.push_back(raw_rule.probs[j]);
 			}
-			for (auto pos : tgt_rule.aligned_src_positions)
+		}
+		sort(values.begin(),values.end());
+		vector<double> distinct_values(values.begin(),unique(values.begin(),values.end()));
+		if (distinct_values.size() <= bin_num)
+		{
+			copy(distinct_values.begin(),distinct_values.end(),centers);
+			fill(centers+distinct_values.size(),centers+bin_num,distinct_values.empty()?0.0:distinct_values.back());
+			continue;
+		}
+		vector<double>::const_iterator start = values.begin(), finish;
+		for (size_t i=0; i<bin_num; i++, start=finish)
+		{
+			finish = values.begin() + values.size()*(i+1)/bin_num;
+			if (finish == start)
 			{
-				cout<<pos<<' ';
+				centers[i] = i ? centers[i-1] : values.front();
 			}
-			cout<<endl;
-			for (auto prob : tgt_rule.probs)
+			else
 			{
-				cout<<prob<<' ';
+				centers[i] = accumulate(start,finish,0.0)/(finish-start);
 			}
-			cout<<endl;
-			cout<<tgt_rule.is_composed_rule<<' '<<tgt_rule.is_lexical_rule<<' '<<endl<<endl<<endl;
 		}
+	}
+}
+
+// 在从小到大排列的码本中查找与概率最接近的值的序号
+int RuleTable::quantize_prob(double prob, const double *centers)
+{
+	size_t bin_num = 1<<PROB_BITS;
+	size_t pos = lower_bound(centers,centers+bin_num,prob) - centers;
+	if (pos == bin_num)
+		return bin_num-1;
+	if (pos > 0 && prob-centers[pos-1] < centers[pos]-prob)
+		return pos-1;
+	return pos;
+}
+
+// 读取规则的PROB_NUM个翻译概率, 量化存储时通过码本还原
+void RuleTable::get_probs(const TgtRule &rule, double *probs)
+{
+	if (PROB_BITS == 0)
+	{
+		memcpy(probs,rule.prob_codes(),sizeof(double)*PROB_NUM);
+		return;
+	}
+	size_t bin_num = 1<<PROB_BITS;
+	for (size_t j=0; j<PROB_NUM; j++)
+	{
+		size_t code = (PROB_BITS == 8) ? static_cast<const uint8_t*>(rule.prob_codes())[j] : static_cast<const uint16_t*>(rule.prob_codes())[j];
+		probs[j] = prob_centers[j*bin_num+code];
+	}
+}
 
-		if (LOAD_ALIGNMENT == true)
+/**************************************************************************************
+ 1. 函数功能: 将加载rule.bin得到的规则Trie树编译成扁平的规则表
+ 2. 入口参数: 无
+ 3. 出口参数: 无
+ 4. 算法简介: a) 按层遍历Trie树, 使每个节点的子节点在节点数组中连续存放
+              b) 收集规则源端的所有标签并编号, 预先解析每个节点对应的源端句法树的一层
+              c) 统计索引和每个节点规则数据的大小, 一次性分配整块内存
+              d) 依次填充节点, 码本, 标签和源端模式, 然后逐个节点填充规则分组, 规则, 整数数据以及翻译概率
+              e) 量化时用码本还原的概率重新计算规则得分并在组内重新排序, 使规则得分等于候选特征的加权和
+***************************************************************************************/
+void RuleTable::compile_trie()
+{
+	vector<RawTrieNode*> raw_nodes = {raw_root};
+	vector<size_t> father_idx = {0};
+	vector<size_t> child_beg;
+	vector<size_t> payload_sizes;
+	vector<size_t> node_int_nums;
+	size_t group_num = 0, rule_num = 0, payload_total = 0;
+	size_t prob_size = (PROB_BITS == 0) ? sizeof(double) : PROB_BITS/8;          // 每个翻译概率所占的字节数
+	size_t center_num = (PROB_BITS == 0) ? 0 : PROB_NUM<<PROB_BITS;
+	for (size_t i=0; i<raw_nodes.size(); i++)
+	{
+		RawTrieNode *raw_node = raw_nodes[i];
+		child_beg.push_back(raw_nodes.size());
+		for (auto &kvp : raw_node->subtrie_map)
 		{
-			short int alignment_num=0;
-			fin.read((char*)&alignment_num,sizeof(short int));
-			int *alignment_array = new int[alignment_num];
-			fin.read((char*)alignment_array,sizeof(int)*alignment_num);
+			raw_nodes.push_back(kvp.second);
+			father_idx.push_back(i);
+		}
+		if (i == 0)                                                       // 根节点的子节点按标签排序, 以便二分查找
+		{
+			sort(raw_nodes.begin()+1,raw_nodes.end(),[this](const RawTrieNode *a, const RawTrieNode *b)
+					{return src_vocab->get_word(a->rule_level_id) < src_vocab->get_word(b->rule_level_id);});
+		}
+		size_t node_rule_num = raw_node->tgt_rules.size(), node_int_num = 0;
+		for (auto &kvp : raw_node->tgt_rule_group)
+		{
+			node_int_num += kvp.first.size();
+		}
+		for (const auto &tgt_rule : raw_node->tgt_rules)
+		{
+			node_int_num += tgt_rule.tgt_leaves.size()*2 + tgt_rule.alignment.size();
+		}
+		group_num += raw_node->tgt_rule_group.size();
+		rule_num  += node_rule_num;
+		node_int_nums.push_back(node_int_num);
+		payload_sizes.push_back(align8(sizeof(RuleGroup)*raw_node->tgt_rule_group.size() + sizeof(TgtRule)*node_rule_num
+					                   + sizeof(int)*node_int_num + prob_size*node_rule_num*PROB_NUM));
+		payload_total += payload_sizes.back();
+	}
+	size_t node_num = raw_nodes.size();
 
-			tgt_rule.s2t_pos_map.resize(src_rule_len);
-			for(size_t i=0;i<alignment_num/2;i++)
+	map<string,int> label2id;
+	for (size_t i=1; i<node_num; i++)
+	{
+		string rule_level_str = src_vocab->get_word(raw_nodes[i]->rule_level_id);
+		if (father_idx[i] == 0)
+		{
+			label2id[rule_level_str] = 0;
+			continue;
+		}
+		for (const auto &leaf_str : Split(rule_level_str,"|||"))
+		{
+			if (leaf_str == "~")
+				continue;
+			for (const auto &label : Split(leaf_str))
 			{
-				int ch_pos = alignment_array[2*i];
-				int en_pos = alignment_array[2*i+1];
-				tgt_rule.s2t_pos_map[ch_pos].push_back(en_pos);
+				label2id[label] = 0;
 			}
 		}
+	}
+	size_t label_num = 0, char_num = 0;
+	for (auto &kvp : label2id)
+	{
+		kvp.second = label_num++;
+		char_num  += kvp.first.size();
+	}
+	vector<vector<int> > patterns(node_num);
+	size_t pattern_int_num = 0;
+	for (size_t i=1; i<node_num; i++)
+	{
+		patterns[i] = compile_pattern(src_vocab->get_word(raw_nodes[i]->rule_level_id),father_idx[i]==0,label2id);
+		pattern_int_num += patterns[i].size();
+	}
+
+	size_t payload_offset = align8(sizeof(RuleTableHeader) + sizeof(RuleTrieNode)*node_num + sizeof(double)*center_num + sizeof(uint64_t)*(label_num+1)
+		                           + sizeof(int)*pattern_int_num + char_num);
+	size_t total_size = payload_offset + payload_total;
+	void *mem = calloc(total_size,1);
+	if (mem == NULL)
+	{
+		cerr<<"cannot allocate memory for rule table!\n";
+		exit(1);
+	}
+	table_memory.reset(mem,total_size,util::scoped_memory::MALLOC_ALLOCATED);
+
+	RuleTableHeader *header = reinterpret_cast<RuleTableHeader*>(mem);
+	RuleTrieNode *nodes     = reinterpret_cast<RuleTrieNode*>(header+1);
+	double *centers         = reinterpret_cast<double*>(nodes+node_num);
+	uint64_t *char_offsets  = reinterpret_cast<uint64_t*>(centers+center_num);
+	int *pattern_ints       = reinterpret_cast<int*>(char_offsets+label_num+1);
+	char *chars             = reinterpret_cast<char*>(pattern_ints+pattern_int_num);
+	char *payload           = reinterpret_cast<char*>(mem)+payload_offset;
 
+	memcpy(header->magic,RULE_TABLE_MAGIC,sizeof(RULE_TABLE_MAGIC));
+	header->version        = RULE_TABLE_VERSION;
+	header->load_alignment = LOAD_ALIGNMENT;
+	header->rule_num_limit = RULE_NUM_LIMIT;
+	header->prob_bits      = PROB_BITS;
+	for (size_t i=0; i<PROB_NUM && i<weight.trans.size(); i++)
+	{
+		header->trans_weights[i] = weight.trans[i];
+	}
+	header->node_num        = node_num;
+	header->group_num       = group_num;
+	header->rule_num        = rule_num;
+	header->label_num       = label_num;
+	header->pattern_int_num = pattern_int_num;
+	header->char_num        = char_num;
+	header->payload_offset  = payload_offset;
+	header->total_size      = total_size;
+
+	if (PROB_BITS != 0)
+	{
+		make_prob_codebook(raw_nodes,centers);
+		cout<<"quantize translation probabilities to "<<PROB_BITS<<" bits, save "<<(sizeof(double)-prob_size)*rule_num*PROB_NUM<<" bytes\n";
+	}
 
-		tgt_rule.score = 0;
-		if( tgt_rule.probs.size() != weight.trans.size() )
+	char_offsets[0] = 0;
+	size_t label_idx = 0;
+	for (const auto &kvp : label2id)
+	{
+		memcpy(chars+char_offsets[label_idx],kvp.first.data(),kvp.first.size());
+		char_offsets[label_idx+1] = char_offsets[label_idx] + kvp.first.size();
+		label_idx++;
+	}
+
+	int *pattern_int = pattern_ints;
+	for (size_t i=0; i<node_num; i++)
+	{
+		RawTrieNode *raw_node = raw_nodes[i];
+		RuleTrieNode &node    = nodes[i];
+		node.father_offset    = (i == 0) ? 0 : offset_between(&node,&nodes[father_idx[i]]);
+		node.child_offset     = offset_between(&node,&nodes[child_beg[i]]);
+		node.pattern_offset   = offset_between(&node,pattern_int);
+		node.pattern_len      = patterns[i].size();
+		pattern_int           = copy(patterns[i].begin(),patterns[i].end(),pattern_int);
+		node.child_num        = raw_node->subtrie_map.size();
+		node.group_num        = raw_node->tgt_rule_group.size();
+		node.rule_level_id    = raw_node->rule_level_id;
+		node.group_offset     = offset_between(&node,payload);
+		node.payload_size     = payload_sizes[i];
+
+		RuleGroup *group = reinterpret_cast<RuleGroup*>(payload);
+		TgtRule *rule    = reinterpret_cast<TgtRule*>(group+node.group_num);
+		int *cur_int     = reinterpret_cast<int*>(rule+raw_node->tgt_rules.size());
+		char *prob       = reinterpret_cast<char*>(cur_int+node_int_nums[i]);
+		for (auto &kvp : raw_node->tgt_rule_group)
 		{
-			cout<<"number of probability in rule is wrong!"<<endl;
+			group->key_offset  = offset_between(group,cur_int);
+			group->key_len     = kvp.first.size();
+			cur_int            = copy(kvp.first.begin(),kvp.first.end(),cur_int);
+			group->rule_offset = offset_between(group,rule);
+			group->rule_num    = kvp.second.size();
+			for (const auto rule_idx : kvp.second)
+			{
+				const RawTgtRule &raw_rule = raw_node->tgt_rules[rule_idx];
+				rule->leaf_offset      = offset_between(rule,cur_int);
+				rule->leaf_num         = raw_rule.tgt_leaves.size();
+				cur_int                = copy(raw_rule.tgt_leaves.begin(),raw_rule.tgt_leaves.end(),cur_int);
+				cur_int                = copy(raw_rule.aligned_src_positions.begin(),raw_rule.aligned_src_positions.end(),cur_int);
+				rule->prob_offset      = offset_between(rule,prob);
+				for (size_t j=0; j<PROB_NUM; j++, prob+=prob_size)
+				{
+					if (PROB_BITS == 0)
+						memcpy(prob,&raw_rule.probs[j],sizeof(double));
+					else if (PROB_BITS == 8)
+						*reinterpret_cast<uint8_t*>(prob) = quantize_prob(raw_rule.probs[j],centers+(j<<PROB_BITS));
+					else
+						*reinterpret_cast<uint16_t*>(prob) = quantize_prob(raw_rule.probs[j],centers+(j<<PROB_BITS));
+				}
+				rule->align_offset     = offset_between(rule,cur_int);
+				rule->align_num        = raw_rule.alignment.size()/2;
+				rule->node_rank        = raw_rule.node_rank;
+				cur_int                = copy(raw_rule.alignment.begin(),raw_rule.alignment.end(),cur_int);
+				rule->score            = raw_rule.score;
+				rule->tgt_root         = raw_rule.tgt_root;
+				rule->word_num         = raw_rule.word_num;
+				rule->is_composed_rule = raw_rule.is_composed_rule;
+				rule->is_lexical_rule  = raw_rule.is_lexical_rule;
+				rule++;
+			}
+			group++;
 		}
-		for( size_t i=0; i<weight.trans.size(); i++ )
+		payload += payload_sizes[i];
+	}
+	set_table_pointers();
+	if (PROB_BITS != 0)                                                       // 规则得分改由量化后的概率计算, 与候选所用的翻译概率一致
+	{
+#pragma omp parallel for schedule(dynamic,64) num_threads(LOAD_THREAD_NUM)
+		for (size_t i=0; i<node_num; i++)
 		{
-			tgt_rule.score += tgt_rule.probs[i]*weight.trans[i];
+			rescore_rule_groups(const_cast<RuleGroup*>(nodes[i].groups()),nodes[i].group_num);
 		}
+	}
+}
 
-		add_rule_to_trie(rulenode_ids,tgt_rule);
+// 根据规则表的文件头找到各部分数据的起始位置
+void RuleTable::set_table_pointers()
+{
+	const RuleTableHeader *header = reinterpret_cast<const RuleTableHeader*>(table_memory.get());
+	root          = reinterpret_cast<const RuleTrieNode*>(header+1);
+	PROB_BITS     = header->prob_bits;
+	prob_centers  = reinterpret_cast<const double*>(root+header->node_num);
+	label_num     = header->label_num;
+	label_offsets = reinterpret_cast<const uint64_t*>(prob_centers+(PROB_BITS==0?0:PROB_NUM<<PROB_BITS));
+	label_chars   = reinterpret_cast<const char*>(reinterpret_cast<const int*>(label_offsets+label_num+1)+header->pattern_int_num);
+}
+
+bool RuleTable::is_compiled_rule_table(const string &rule_table_file)
+{
+	ifstream fin(rule_table_file.c_str(),ios::binary);
+	char magic[sizeof(RULE_TABLE_MAGIC)];
+	if (!fin.read(magic,sizeof(magic)))
+		return false;
+	return memcmp(magic,RULE_TABLE_MAGIC,sizeof(magic)) == 0;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 通过mmap加载编译后的规则表
+ 2. 入口参数: 编译后的规则表文件名
+ 3. 出口参数: 无
+ 4. 算法简介: a) 规则表不做任何解析, 直接在映射的内存中原地查询, 多个进程共享页缓存
+              b) 若设置了RULE-CACHE-SIZE, 则只映射索引部分, 规则数据在匹配到时才从文件读取,
+                 并放入所有线程共享的缓存中, 见get_rule_groups
+              c) 翻译概率权重与编译时不同时只给出警告, 不自动重新打分(重新打分会产生私有的
+                 规则表副本), 由调用者决定是否调用rescore, 见main
+***************************************************************************************/
+void RuleTable::load_compiled_rule_table(const string &compiled_file)
+{
+	table_fd.reset(util::OpenReadOrThrow(compiled_file.c_str()));
+	util::scoped_fd &fd = table_fd;
+	RuleTableHeader header;
+	util::ReadOrThrow(fd.get(),&header,sizeof(header));
+	if (header.version != RULE_TABLE_VERSION || header.total_size != util::SizeOrThrow(fd.get()))
+	{
+		cerr<<"compiled rule table "<<compiled_file<<" is broken or has a wrong version!\n";
+		exit(1);
+	}
+	if (header.load_alignment != LOAD_ALIGNMENT)
+	{
+		cerr<<"warning: compiled rule table was built with different LOAD-ALIGNMENT\n";
+	}
+	if (header.rule_num_limit < (uint64_t)RULE_NUM_LIMIT)
+	{
+		cerr<<"warning: compiled rule table only keeps "<<header.rule_num_limit<<" rules for each source side\n";
+	}
+	if (header.prob_bits != PROB_BITS)
+	{
+		cerr<<"warning: compiled rule table stores translation probabilities with "<<header.prob_bits<<" bits, PROB-BITS is ignored\n";
+	}
+	for (size_t i=0; i<weight.trans.size() && i<PROB_NUM; i++)
+	{
+		if (header.trans_weights[i] != weight.trans[i])
+		{
+			is_score_stale = true;
+		}
+	}
+	is_table_writable = false;
+	if (RULE_CACHE_SIZE != 0)
+	{
+		util::MapRead(util::LAZY,fd.get(),0,header.payload_offset,table_memory);
+		rule_cache = new RuleCache(RULE_CACHE_SIZE<<20);
+		set_table_pointers();
+		cout<<"map index of compiled rule table file "<<compiled_file<<" over, rules will be loaded on demand\n";
+	}
+	else
+	{
+		util::MapRead(util::LAZY,fd.get(),0,header.total_size,table_memory);
+		set_table_pointers();
+		cout<<"map compiled rule table file "<<compiled_file<<" over\n";
+	}
+	if (is_score_stale)
+	{
+		cerr<<"warning: compiled rule table was scored with different trans weights\n";
 	}
-	fin.close();
-	cout<<"load rule table file "<<rule_table_file<<" over\n";
 }
 
-void RuleTable::add_rule_to_trie(const vector<int> &rulenode_ids, const TgtRule &tgt_rule)
+/**************************************************************************************
+ 1. 函数功能: 用新的特征权重重新计算所有规则的得分, 并重新排序, 供调参时在同一进程中反复解码,
+             或者与-compile-rule-table一起生成按新权重打分的规则表文件
+ 2. 入口参数: 新的特征权重
+ 3. 出口参数: 无
+ 4. 算法简介: a) 规则表来自mmap时, 先以MAP_PRIVATE方式重新映射为可写, 修改不会写回文件
+              b) 各线程并行处理不同的Trie节点, 见rescore_rule_groups
+              c) 按需加载时只清空缓存, 之后读入的规则数据在放入缓存前重新打分
+              注意: 规则表在加载时已经按原来的权重截取了前RULE_NUM_LIMIT条规则, 调参时应使用较大的
+              RULE-NUM-LIMIT编译规则表, 解码时再用较小的限制截断(见get_rule_num);
+              本函数不能与翻译线程同时调用, 语言模型等其他特征的权重由调用者传给SentenceTranslator
+***************************************************************************************/
+void RuleTable::rescore(const Weight &new_weight)
 {
-	RuleTrieNode* current = root;
-	for (const auto &node_id : rulenode_ids)
-	{        
-		string node_str = src_vocab->get_word(node_id);
-		auto it = current->subtrie_map.find(node_str);
-		if ( it != current->subtrie_map.end() )
+	weight = new_weight;
+	is_score_stale = false;
+	RuleTableHeader *header = const_cast<RuleTableHeader*>(reinterpret_cast<const RuleTableHeader*>(table_memory.get()));
+	if (rule_cache != NULL)
+	{
+		need_rescore_block = true;
+		rule_cache->clear();
+		return;
+	}
+	if (!is_table_writable)
+	{
+		size_t table_size = table_memory.size();
+		table_memory.reset(util::MapOrThrow(table_size,true,MAP_PRIVATE,false,table_fd.get(),0),table_size,util::scoped_memory::MMAP_ALLOCATED);
+		table_fd.reset();
+		is_table_writable = true;
+		header = reinterpret_cast<RuleTableHeader*>(table_memory.get());
+		set_table_pointers();
+	}
+	for (size_t i=0; i<PROB_NUM && i<weight.trans.size(); i++)
+	{
+		header->trans_weights[i] = weight.trans[i];
+	}
+	size_t node_num = header->node_num;
+#pragma omp parallel for schedule(dynamic,64) num_threads(LOAD_THREAD_NUM)
+	for (size_t i=0; i<node_num; i++)
+	{
+		const RuleTrieNode &node = root[i];
+		rescore_rule_groups(const_cast<RuleGroup*>(node.groups()),node.group_num);
+	}
+}
+
+/**************************************************************************************
+ 1. 函数功能: 重新计算一个Trie节点所有规则的得分, 组内按新得分排序, 并更新规则在节点中的排名
+ 2. 入口参数: 节点的规则分组, 分组个数
+ 3. 出口参数: 无
+ 4. 算法简介: 规则通过相对于自身地址的偏移量引用叶节点等数据, 在组内移动规则时需要相应地调整偏移量;
+              得分相同的规则保持原来的相对顺序
+***************************************************************************************/
+void RuleTable::rescore_rule_groups(RuleGroup *groups, int group_num)
+{
+	const int64_t rule_size = sizeof(TgtRule);
+	vector<TgtRule*> rules_of_node;
+	double probs[PROB_NUM];
+	for (RuleGroup *group=groups; group!=groups+group_num; group++)
+	{
+		TgtRule *rules = const_cast<TgtRule*>(group->rules());
+		vector<TgtRule> sorted_rules(rules,rules+group->rule_num);
+		for (int i=0; i<group->rule_num; i++)
 		{
-			current = it->second;
+			get_probs(rules[i],probs);
+			double score = 0;
+			for (size_t j=0; j<weight.trans.size() && j<PROB_NUM; j++)
+			{
+				score += probs[j]*weight.trans[j];
+			}
+			sorted_rules[i].score         = score;
+			sorted_rules[i].leaf_offset  += i*rule_size;               // 偏移量改为相对于rules的起始位置
+			sorted_rules[i].prob_offset  += i*rule_size;
+			sorted_rules[i].align_offset += i*rule_size;
+		}
+		stable_sort(sorted_rules.begin(),sorted_rules.end(),[](const TgtRule &a, const TgtRule &b){return a.score > b.score;});
+		for (int i=0; i<group->rule_num; i++)
+		{
+			sorted_rules[i].leaf_offset  -= i*rule_size;
+			sorted_rules[i].prob_offset  -= i*rule_size;
+			sorted_rules[i].align_offset -= i*rule_size;
+			rules[i] = sorted_rules[i];
+			rules_of_node.push_back(&rules[i]);
 		}
+	}
+	stable_sort(rules_of_node.begin(),rules_of_node.end(),[](const TgtRule *a, const TgtRule *b){return a->score > b->score;});
+	for (size_t rank=0; rank<rules_of_node.size(); rank++)
+	{
+		rules_of_node[rank]->node_rank = rank;
+	}
+}
+
+void RuleTable::save_compiled_rule_table(const string &compiled_file)
+{
+	util::scoped_fd fd(util::CreateOrThrow(compiled_file.c_str()));
+	util::WriteOrThrow(fd.get(),table_memory.get(),table_memory.size());
+	cout<<"save compiled rule table file "<<compiled_file<<" over\n";
+}
+
+/**************************************************************************************
+ 1. 函数功能: 查找规则Trie树根节点下与给定句法标签对应的子节点
+ 2. 入口参数: 句法标签id
+ 3. 出口参数: 找到的子节点, 找不到返回NULL
+ 4. 算法简介: 根节点的子节点按标签id有序存放, 二分查找即可
+***************************************************************************************/
+const RuleTrieNode* RuleTable::find_subtrie_of_root(int label_id)
+{
+	const RuleTrieNode *beg = root->children(), *end = root->children()+root->child_num;
+	const RuleTrieNode *it = lower_bound(beg,end,label_id,
+			[](const RuleTrieNode &child, int id) {return child.pattern()[0] < id;});
+	if ( it == end || it->pattern()[0] != label_id )
+		return NULL;
+	return it;
+}
+
+// 查找句法标签或词在规则表标签中的id, 规则源端没有出现过的返回-1
+int RuleTable::find_label_id(const string &label)
+{
+	size_t beg = 0, end = label_num;
+	while (beg < end)
+	{
+		size_t mid = (beg+end)/2;
+		int cmp = label.compare(0,string::npos,label_chars+label_offsets[mid],label_offsets[mid+1]-label_offsets[mid]);
+		if (cmp == 0)
+			return mid;
+		if (cmp > 0)
+			beg = mid+1;
 		else
+			end = mid;
+	}
+	return -1;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 获取规则Trie树节点的所有规则分组
+ 2. 入口参数: 规则Trie树节点, 当前句子持有的规则数据块
+ 3. 出口参数: 规则分组的起始位置, 共node->group_num个
+ 4. 算法简介: 规则表整体映射时直接返回; 按需加载时先查缓存, 未命中则从文件读取该节点的规则数据,
+              并将数据块加入pinned_blocks, 保证句子翻译结束前候选所引用的规则一直有效
+***************************************************************************************/
+const RuleGroup* RuleTable::get_rule_groups(const RuleTrieNode *node, vector<RuleBlockPtr> &pinned_blocks)
+{
+	if (rule_cache == NULL || node->group_num == 0)
+		return node->groups();
+	RuleBlockPtr block = rule_cache->find(node);
+	if (!block)
+	{
+		shared_ptr<RuleBlock> new_block(new RuleBlock);
+		new_block->data.resize(node->payload_size/sizeof(uint64_t));
+		uint64_t file_offset = reinterpret_cast<const char*>(node) - reinterpret_cast<const char*>(table_memory.get()) + node->group_offset;
+		util::PReadOrThrow(table_fd.get(),new_block->data.data(),node->payload_size,file_offset);
+		if (need_rescore_block)
 		{
-			RuleTrieNode* tmp = new RuleTrieNode();
-			tmp->father = current;
-			tmp->rule_level_str = node_str;
-			current->subtrie_map.insert(make_pair(node_str,tmp));
-			current = tmp;
+			rescore_rule_groups(reinterpret_cast<RuleGroup*>(new_block->data.data()),node->group_num);
 		}
+		block = rule_cache->insert(node,new_block);
 	}
-	if (current->tgt_rules.size() < RULE_NUM_LIMIT)
+	pinned_blocks.push_back(block);
+	return reinterpret_cast<const RuleGroup*>(block->data.data());
+}
+
+void RuleTable::print_cache_info()
+{
+	if (rule_cache == NULL)
+		return;
+	cout<<"rule cache hits: "<<rule_cache->hit_num<<" misses: "<<rule_cache->miss_num<<" evictions: "<<rule_cache->evict_num<<endl;
+}
+
+// 返回规则分组在当前RULE_NUM_LIMIT下可用的规则数, 规则表编译时的限制更大时截掉排名靠后的规则
+int RuleTable::get_rule_num(const RuleGroup *group)
+{
+	const TgtRule *beg = group->rules(), *end = group->rules()+group->rule_num;
+	if (group->rule_num == 0 || end[-1].node_rank < RULE_NUM_LIMIT)
+		return group->rule_num;
+	return partition_point(beg,end,[this](const TgtRule &rule){return rule.node_rank < RULE_NUM_LIMIT;}) - beg;
+}
+
+const RuleGroup* RuleTable::find_group(const RuleGroup *groups, int group_num, const vector<int> &group_id)
+{
+	const RuleGroup *beg = groups, *end = groups+group_num;
+	auto key_less = [](const RuleGroup &group, const vector<int> &key)
 	{
-		current->tgt_rules.push_back(tgt_rule);
+		return lexicographical_compare(group.group_id(),group.group_id()+group.key_len,key.begin(),key.end());
+	};
+	const RuleGroup *it = lower_bound(beg,end,group_id,key_less);
+	if ( it == end || it->key_len != (int)group_id.size() || !equal(group_id.begin(),group_id.end(),it->group_id()) )
+		return NULL;
+	return it;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 获取当前句法节点匹配到的所有规则
+ 2. 入口参数: 当前句法节点的指针
+ 3. 出口参数: 所有匹配上的规则
+ 4. 算法简介: 按层遍历规则Trie树, 对于每一层中的每一条匹配上的规则, 考察它的下一层规则
+************************************************************************************* */
+vector<RuleMatchInfo> RuleTable::find_matched_rules_for_syntax_node(SyntaxNode* cur_node)
+{
+	vector<RuleMatchInfo> match_info_vec;
+	const RuleTrieNode *rule_node = find_subtrie_of_root(cur_node->label_id);
+	if ( rule_node == NULL )                                               // 没找到可用的规则, 此处不必要求Trie节点包含规则目标端, 以便进行扩展
+		return match_info_vec;
+	RuleMatchInfo root_rule = {rule_node,cur_node,{cur_node}};             // 一元规则, 即规则源端只含一个根节点
+	match_info_vec.push_back(root_rule);
+	size_t last_beg = 0, last_end = match_info_vec.size();                 // 记录规则Trie树当前层匹配上的规则在match_info_vec中的起始和终止位置
+	while(last_beg != last_end)
+	{
+		for (size_t cur_pos=last_beg; cur_pos!=last_end; cur_pos++)        // 对当前层匹配上的规则进行扩展
+		{
+			push_matched_rules_at_next_level(match_info_vec,cur_pos);
+		}
+		last_beg = last_end;
+		last_end = match_info_vec.size();
 	}
-	else
+	return match_info_vec;
+}
+
+/**************************************************************************************
+ 1. 函数功能: 考察当前匹配上的规则的下一层规则, 将能匹配上的加入match_info_vec
+ 2. 入口参数: 当前匹配上的规则在match_info_vec中的位置
+ 3. 出口参数: 记录所有匹配规则的match_info_vec
+ 4. 算法简介: 遍历下一层规则, 将每条规则预先解析好的源端与句法树节点的标签id进行对比, 看能否匹配上
+***************************************************************************************/
+void RuleTable::push_matched_rules_at_next_level(vector<RuleMatchInfo> &match_info_vec, size_t cur_pos)
+{
+	RuleMatchInfo cur_match_info = match_info_vec.at(cur_pos);                     // 此处不能用引用, 因为match_info_vec会因扩容而改变地址
+	const RuleTrieNode *children = cur_match_info.rule_node->children();
+	for (const RuleTrieNode *child=children; child!=children+cur_match_info.rule_node->child_num; child++)
 	{
-		auto it = min_element(current->tgt_rules.begin(), current->tgt_rules.end());
-		if( it->score < tgt_rule.score )
+		if ( !is_pattern_matched(child,cur_match_info.syntax_leaves) )
+			continue;
+		vector<SyntaxNode*> new_leaves;
+		const int *pattern = child->pattern();
+		for(size_t i=0; i<cur_match_info.syntax_leaves.size(); i++)
 		{
-			(*it) = tgt_rule;
+			int expanded_num = *pattern++;
+			if (expanded_num == -1)                                                // 该节点不进行扩展, 直接将原规则的叶节点作为新规则的叶节点
+			{
+				new_leaves.push_back(cur_match_info.syntax_leaves[i]);
+				continue;
+			}
+			pattern += expanded_num;
+			vector<SyntaxNode*> &leaves_of_cur_child = cur_match_info.syntax_leaves[i]->children;
+			new_leaves.insert(new_leaves.end(), leaves_of_cur_child.begin(), leaves_of_cur_child.end());
 		}
+		RuleMatchInfo new_match_info = {child,cur_match_info.syntax_root,new_leaves};
+		match_info_vec.push_back(new_match_info);
 	}
 }
 
-void RuleTable::group_rules_for_subtrie(RuleTrieNode *node)
+/**************************************************************************************
+ 1. 函数功能: 判断规则节点对应的源端句法树的一层能否与句法树片段的叶节点匹配上
+ 2. 入口参数: 规则节点, 当前句法树片段的叶节点
+ 3. 出口参数: 能否匹配
+ 4. 算法简介: 依次考察每个叶节点, 不扩展的叶节点直接匹配, 扩展的叶节点要求扩展出的
+              节点数以及每个节点的标签id都相同
+***************************************************************************************/
+bool RuleTable::is_pattern_matched(const RuleTrieNode *rule_node, const vector<SyntaxNode*> &syntax_leaves)
 {
-	node->group_and_sort_tgt_rules();
-	for (auto &kvp : node->subtrie_map)
+	const int *pattern = rule_node->pattern(), *pattern_end = rule_node->pattern()+rule_node->pattern_len;
+	for (const auto syntax_leaf : syntax_leaves)
 	{
-		group_rules_for_subtrie(kvp.second);
+		if (pattern == pattern_end)                                                // 规则源端叶节点比句法树片段的叶节点少
+			return false;
+		int expanded_num = *pattern++;
+		if (expanded_num == -1)
+			continue;
+		if ( (size_t)expanded_num != syntax_leaf->children.size() )                        // 规则源端叶节点与对应的句法树叶节点扩展出来的节点数不同
+			return false;
+		for (const auto child : syntax_leaf->children)
+		{
+			if (*pattern++ != child->label_id)
+				return false;
+		}
+	}
+	return true;
+}
+
+RuleCache::RuleCache(size_t i_budget)
+{
+	budget    = i_budget;
+	used      = 0;
+	hit_num   = 0;
+	miss_num  = 0;
+	evict_num = 0;
+	omp_init_lock(&lock);
+}
+
+RuleCache::~RuleCache()
+{
+	omp_destroy_lock(&lock);
+}
+
+// 查找节点的规则数据, 命中时将其移到表头; 未命中返回空指针
+RuleBlockPtr RuleCache::find(const RuleTrieNode *node)
+{
+	RuleBlockPtr block;
+	omp_set_lock(&lock);
+	auto it = node_to_pos.find(node);
+	if (it != node_to_pos.end())
+	{
+		lru_list.splice(lru_list.begin(),lru_list,it->second);
+		block = it->second->second;
+		hit_num++;
+	}
+	else
+	{
+		miss_num++;
 	}
+	omp_unset_lock(&lock);
+	return block;
 }
 
+/**************************************************************************************
+ 1. 函数功能: 将从文件读取的规则数据加入缓存
+ 2. 入口参数: 规则Trie树节点, 该节点的规则数据
+ 3. 出口参数: 缓存中该节点的规则数据
+ 4. 算法简介: 读取文件时不加锁, 因此其他线程可能已经加入了同一节点, 此时使用缓存中已有的数据;
+              加入后从表尾淘汰最久未使用的节点, 直到总大小不超过预算(至少保留刚加入的节点)
+***************************************************************************************/
+RuleBlockPtr RuleCache::insert(const RuleTrieNode *node, const RuleBlockPtr &block)
+{
+	RuleBlockPtr result = block;
+	omp_set_lock(&lock);
+	auto it = node_to_pos.find(node);
+	if (it != node_to_pos.end())
+	{
+		lru_list.splice(lru_list.begin(),lru_list,it->second);
+		result = it->second->second;
+	}
+	else
+	{
+		lru_list.push_front(make_pair(node,block));
+		node_to_pos.insert(make_pair(node,lru_list.begin()));
+		used += block->data.size()*sizeof(uint64_t);
+		while (used > budget && lru_list.size() > 1)
+		{
+			used -= lru_list.back().second->data.size()*sizeof(uint64_t);
+			node_to_pos.erase(lru_list.back().first);
+			lru_list.pop_back();
+			evict_num++;
+		}
+	}
+	omp_unset_lock(&lock);
+	return result;
+}
+
+// 清空缓存, 已被句子持有的数据块在句子结束后释放
+void RuleCache::clear()
+{
+	omp_set_lock(&lock);
+	lru_list.clear();
+	node_to_pos.clear();
+	used = 0;
+	omp_unset_lock(&lock);
+}
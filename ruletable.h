@@ -2,53 +2,236 @@
 #define RULETABLE_H
 #include "stdafx.h"
 #include "vocab.h"
+#include "util/mmap.hh"
+#include "util/file.hh"
 
-struct TgtRule
+// 加载rule.bin时使用的目标端规则, 编译成扁平规则表之后即释放
+struct RawTgtRule
 {
-	bool operator<(const TgtRule &rhs) const{return score < rhs.score;};
+	bool operator<(const RawTgtRule &rhs) const{return score < rhs.score;};
+	bool is_better_than(const RawTgtRule &rhs) const{return score > rhs.score || (score == rhs.score && load_order < rhs.load_order);};
 	int word_num;                               // 规则目标端的单词数
 	int tgt_root;                               // 规则目标端根节点的标签
 	vector<int> tgt_leaves;                     // 规则目标端叶节点的单词或非终结符的id序列
 	vector<int> aligned_src_positions;          // 规则目标端的单词或非终结符在规则源端句法树片段叶节点序列中的位置, 单词对应-1
-	vector<int> group_id;                       // 规则目标端叶节点的非终结符及其对齐所构成的规则分组标识符
-	vector<vector<int> > s2t_pos_map;           // 记录规则源端每个单词对应到目标端哪些单词
+	vector<int> alignment;                      // 规则内部的词对齐, 源端位置和目标端位置交替存放, 按源端位置排序
 	double score;                               // 规则打分, 即翻译概率与特征权重的加权
 	vector<double> probs;                       // 翻译概率和词汇权重
 	short int is_composed_rule;                 // 记录该规则是最小规则还是组合规则
 	short int is_lexical_rule;                  // 记录该规则是完全词汇化规则还是非词汇化规则
+	int load_order;                             // 该规则是当前规则源端在rule.bin中的第几条规则, 得分相同时先出现的优先
+	int node_rank;                              // 该规则在当前规则源端所有目标端中按得分的排名
 };
 
-class RuleTrieNode 
+// 加载rule.bin时使用的规则Trie树节点
+class RawTrieNode
 {
 	public:
-		RuleTrieNode()
+		RawTrieNode()
 		{
 			father = NULL;
+			loaded_rule_num = 0;
+		}
+		~RawTrieNode()
+		{
+			for (auto &kvp : subtrie_map)
+			{
+				delete kvp.second;
+			}
 		}
 		void group_and_sort_tgt_rules();
 	public:
-		vector<TgtRule> tgt_rules;                             // 一个规则源端对应的所有目标端
-		map <vector<int>, vector<TgtRule> > tgt_rule_group;    // 根据规则目标端叶节点的句法标签对规则进行分组, 对s2t/t2t系统有用
-		map <string, RuleTrieNode*> subtrie_map;               // 当前规则节点到下个规则节点的转换表, key为源端句法树的一层
-		RuleTrieNode *father;                                  // 当前规则节点的父节点, 调试时打印规则用
-		string rule_level_str;                                 // 当前规则节点对应的源端句法树(填充过的, 所有叶节点位于同一层)的最下一层
+		vector<RawTgtRule> tgt_rules;                          // 一个规则源端对应的所有目标端, 加载时为以最差规则为堆顶的堆
+		int loaded_rule_num;                                   // rule.bin中当前规则源端已经读到的目标端个数
+		map <vector<int>, vector<int> > tgt_rule_group;        // 根据规则目标端叶节点的句法标签对规则进行分组, 对s2t/t2t系统有用; 值为规则在tgt_rules中的序号
+		map <int, RawTrieNode*> subtrie_map;                   // 当前规则节点到下个规则节点的转换表, key为源端句法树的一层在源端词表中的id
+		RawTrieNode *father;                                   // 当前规则节点的父节点
+		int rule_level_id;                                     // 当前规则节点对应的源端句法树的最下一层在源端词表中的id
+};
+
+/**************************************************************************************
+ 编译后的规则表: 所有结构都是定长的, 并通过相对于自身地址的偏移量引用其他数据,
+ 因此整个规则表是一块与地址无关的连续内存, 既可以直接写入文件, 也可以mmap之后原地查询.
+ 文件布局: RuleTableHeader | RuleTrieNode[] | double[] | uint64_t[] | int[] | char[] | 各节点的规则数据
+ 其中节点, 翻译概率的码本, 标签和预先解析的源端模式构成Trie树的索引, 用于规则匹配;
+ 每个节点的规则数据(RuleGroup[] | TgtRule[] | int[] | 翻译概率)连续存放且只在内部互相引用,
+ 因此按需加载时可以单独读入内存中的任意位置使用
+***************************************************************************************/
+template <class T> inline const T* rel_ptr(const void *self, int64_t offset)
+{
+	return reinterpret_cast<const T*>(reinterpret_cast<const char*>(self) + offset);
+}
+
+struct TgtRule
+{
+	const int*    tgt_leaves() const            {return rel_ptr<int>(this,leaf_offset);};
+	const int*    aligned_src_positions() const {return tgt_leaves()+leaf_num;};
+	const void*   prob_codes() const            {return rel_ptr<void>(this,prob_offset);};  // 须通过RuleTable::get_probs读取
+	const int*    alignment() const             {return rel_ptr<int>(this,align_offset);};  // 源端位置和目标端位置交替存放
+
+	int64_t leaf_offset;                        // 叶节点id序列, 其后紧跟对齐位置序列
+	int64_t prob_offset;                        // PROB_NUM个翻译概率, 量化时为每个概率在码本中的序号
+	int64_t align_offset;                       // 规则内部的词对齐
+	double score;                               // 规则打分, 即翻译概率与特征权重的加权
+	int tgt_root;                               // 规则目标端根节点的标签
+	int word_num;                               // 规则目标端的单词数
+	int leaf_num;                               // 规则目标端的叶节点数
+	int align_num;                              // 词对齐的个数
+	int node_rank;                              // 该规则在同一规则源端所有目标端中按得分的排名, 用于在解码时进一步限制规则数
+	short int is_composed_rule;                 // 记录该规则是最小规则还是组合规则
+	short int is_lexical_rule;                  // 记录该规则是完全词汇化规则还是非词汇化规则
+};
+
+// 目标端非终结符及其对齐相同的一组规则, 按得分从高到低排列
+struct RuleGroup
+{
+	const int*     group_id() const {return rel_ptr<int>(this,key_offset);};
+	const TgtRule* rules() const    {return rel_ptr<TgtRule>(this,rule_offset);};
+
+	int64_t key_offset;
+	int64_t rule_offset;
+	int key_len;
+	int rule_num;
+};
+
+class RuleTrieNode
+{
+	public:
+		const RuleTrieNode* father() const   {return father_offset == 0 ? NULL : rel_ptr<RuleTrieNode>(this,father_offset);};
+		const RuleTrieNode* children() const {return rel_ptr<RuleTrieNode>(this,child_offset);};
+		const RuleGroup*    groups() const   {return rel_ptr<RuleGroup>(this,group_offset);};
+		const int*          pattern() const  {return rel_ptr<int>(this,pattern_offset);};
+
+	public:
+		int64_t father_offset;                                 // 当前规则节点的父节点, 调试时打印规则用; 根节点为0
+		int64_t child_offset;                                  // 子节点连续存放, 根节点的子节点按标签id排序
+		int64_t group_offset;                                  // 根据规则目标端叶节点的句法标签对规则进行分组, 按分组标识符排序
+		int64_t pattern_offset;                                // 预先解析的源端句法树的一层, 见RuleTable::compile_pattern
+		int64_t payload_size;                                  // 该节点规则数据的字节数, 规则数据从groups()开始
+		int child_num;
+		int group_num;
+		int rule_level_id;                                     // 当前规则节点对应的源端句法树(填充过的, 所有叶节点位于同一层)的最下一层
+		int pattern_len;
+};
+
+struct RuleTableHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t load_alignment;                                   // 编译时是否加载了词对齐
+	uint64_t rule_num_limit;                                   // 编译时每个规则源端最多加载的目标端个数
+	uint64_t prob_bits;                                        // 翻译概率的量化位数, 0表示不量化
+	double trans_weights[PROB_NUM];                            // 编译时用于计算规则得分的特征权重
+	uint64_t node_num;
+	uint64_t group_num;
+	uint64_t rule_num;
+	uint64_t label_num;                                        // 规则源端出现的句法标签和词, 按字符串排序, 序号即为标签id
+	uint64_t pattern_int_num;
+	uint64_t char_num;
+	uint64_t payload_offset;                                   // 索引部分的大小, 即第一个节点的规则数据在文件中的位置
+	uint64_t total_size;
+};
+
+// 按需加载时从文件中读入的一个节点的规则数据, 以uint64_t为单位分配以保证对齐
+struct RuleBlock
+{
+	vector<uint64_t> data;
+};
+typedef shared_ptr<const RuleBlock> RuleBlockPtr;
+
+/**************************************************************************************
+ 按需加载时所有翻译线程共享的规则数据缓存, 按最近最少使用的顺序淘汰, 总大小不超过预算.
+ 被淘汰的数据块由正在使用它的句子持有的RuleBlockPtr保证在句子翻译结束前不被释放
+***************************************************************************************/
+class RuleCache
+{
+	public:
+		RuleCache(size_t i_budget);
+		~RuleCache();
+		RuleBlockPtr find(const RuleTrieNode *node);
+		RuleBlockPtr insert(const RuleTrieNode *node, const RuleBlockPtr &block);
+		void clear();
+
+	public:
+		size_t hit_num;
+		size_t miss_num;
+		size_t evict_num;
+
+	private:
+		typedef list<pair<const RuleTrieNode*,RuleBlockPtr> > LruList;
+		LruList lru_list;                                      // 表头为最近使用的节点
+		unordered_map<const RuleTrieNode*,LruList::iterator> node_to_pos;
+		size_t used;                                           // 缓存中规则数据的字节数
+		size_t budget;
+		omp_lock_t lock;
+};
+
+struct SyntaxNode;
+
+// 记录规则匹配信息, 包括规则Trie树的节点, 以及输入句子句法树片段的头节点和叶子节点等信息
+struct RuleMatchInfo
+{
+	const RuleTrieNode* rule_node;
+	SyntaxNode* syntax_root;
+	vector<SyntaxNode*> syntax_leaves;
 };
 
 class RuleTable
 {
 	public:
-		RuleTable(const size_t size_limit,bool load_alignment,const Weight &i_weight,const string &rule_table_file,Vocab *i_src_vocab, Vocab* i_tgt_vocab);
-		RuleTrieNode* get_root() {return root;};
+		RuleTable(const size_t size_limit,bool load_alignment,const size_t load_thread_num,const size_t rule_cache_size,const size_t prob_bits,const Weight &i_weight,const string &rule_table_file,Vocab *i_src_vocab, Vocab* i_tgt_vocab);
+		~RuleTable()
+		{
+			delete rule_cache;
+		}
+		const RuleTrieNode* get_root() {return root;};
+		const RuleTrieNode* find_subtrie_of_root(int label_id);
+		const RuleGroup* get_rule_groups(const RuleTrieNode *node, vector<RuleBlockPtr> &pinned_blocks);
+		const RuleGroup* find_group(const RuleGroup *groups, int group_num, const vector<int> &group_id);
+		int get_rule_num(const RuleGroup *group);
+		void get_probs(const TgtRule &rule, double *probs);
+		int find_label_id(const string &label);
+		vector<RuleMatchInfo> find_matched_rules_for_syntax_node(SyntaxNode* cur_node);
+		void save_compiled_rule_table(const string &compiled_file);
+		void print_cache_info();
+		void rescore(const Weight &new_weight);
+		bool has_stale_scores() {return is_score_stale;}
+		size_t get_rule_size(const char *p, const char *end);
 
 	private:
+		bool is_compiled_rule_table(const string &rule_table_file);
+		void load_compiled_rule_table(const string &compiled_file);
 		void load_rule_table(const string &rule_table_file);
-		void add_rule_to_trie(const vector<int> &node_ids, const TgtRule &tgt_rule);
-		void group_rules_for_subtrie(RuleTrieNode *node);
+		void parse_rule(const char *p, vector<int> &rulenode_ids, RawTgtRule &tgt_rule);
+		void add_rule_to_trie(const vector<int> &node_ids, RawTgtRule &tgt_rule);
+		void group_rules_for_subtrie(RawTrieNode *node);
+		void compile_trie();
+		vector<int> compile_pattern(const string &rule_level_str, bool is_root_level, const map<string,int> &label2id);
+		void make_prob_codebook(const vector<RawTrieNode*> &raw_nodes, double *centers);
+		int quantize_prob(double prob, const double *centers);
+		void set_table_pointers();
+		void rescore_rule_groups(RuleGroup *groups, int group_num);
+		void push_matched_rules_at_next_level(vector<RuleMatchInfo> &match_info_vec, size_t cur_pos);
+		bool is_pattern_matched(const RuleTrieNode *rule_node, const vector<SyntaxNode*> &syntax_leaves);
 
 	private:
-		int RULE_NUM_LIMIT;                      // 每个规则源端最多加载的目标端个数 
+		int RULE_NUM_LIMIT;                      // 每个规则源端最多加载的目标端个数
 		bool LOAD_ALIGNMENT;                     // 是否加载词对齐信息
-		RuleTrieNode *root;                      // 规则Trie树根节点
+		int LOAD_THREAD_NUM;                     // 加载rule.bin时的线程数
+		size_t RULE_CACHE_SIZE;                  // 按需加载编译后规则表时的缓存大小(MB), 为0则映射整个规则表
+		size_t PROB_BITS;                        // 翻译概率的量化位数, 可为0, 8或16; 加载编译后的规则表时以文件为准
+		RawTrieNode *raw_root;                   // 加载rule.bin时的规则Trie树根节点
+		util::scoped_memory table_memory;        // 编译后的规则表, 来自mmap或malloc; 按需加载时只包含索引部分
+		util::scoped_fd table_fd;                // 按需加载时读取规则数据的文件
+		RuleCache *rule_cache;                   // 按需加载时的规则数据缓存, 否则为NULL
+		bool is_table_writable;                  // 规则表是否可以原地修改, 以只读方式mmap时为false
+		bool need_rescore_block;                 // 按需加载时, 文件中的规则得分与当前权重不一致, 读入后需重新打分
+		bool is_score_stale;                     // 编译后规则表中的规则得分是用其它翻译概率权重计算的, 需调用rescore
+		const RuleTrieNode *root;                // 编译后规则Trie树的根节点
+		const uint64_t *label_offsets;           // 每个标签在label_chars中的起止位置
+		const char *label_chars;
+		const double *prob_centers;              // 量化时每个翻译概率的码本, 每个码本有(1<<PROB_BITS)个值
+		size_t label_num;
 		Weight weight;                           // 特征权重
 		Vocab *src_vocab;
 		Vocab *tgt_vocab;
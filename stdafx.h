@@ -8,9 +8,14 @@
 #include <set>
 #include <vector>
 #include <map>
+#include <list>
+#include <deque>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <algorithm>
+#include <numeric>
 #include <bitset>
 #include <queue>
 #include <functional>
@@ -46,19 +51,34 @@ struct Filenames
 	string src_vocab_file;
 	string tgt_vocab_file;
 	string rule_table_file;
+	string compiled_rule_table_file;	//若不为空, 则将规则表编译成可mmap加载的格式写入该文件后退出
 	string lm_file;
+	string coarse_lm_file;				//若不为空, 则先用该低阶语言模型做粗搜索, 再用lm_file只在粗搜索保留的规则应用上做精搜索
+	string forest_file;					//若不为空, 则将每个句子的翻译森林以二进制格式写入该文件
+	string rescore_forest_file;			//若不为空, 则读取该森林文件, 用新的特征权重重新抽取译文和n-best列表, 不需要重新解码
 };
 
-struct Parameter
+struct Parameter						//新增的参数都有默认值, 旧的配置文件中没有这些参数时保持原来的行为
 {
 	size_t BEAM_SIZE;					//优先级队列的大小限制
-	size_t SEN_THREAD_NUM;				//句子级并行数
-	size_t SPAN_THREAD_NUM;				//span级并行数
+	double BEAM_THRESHOLD = 0;			//立方体剪枝时候选得分低于当前节点最好得分超过该值则停止扩展, 为0则不使用
+	size_t BEAM_SIZE_PER_WORD = 0;		//每个节点的候选数不超过该值乘以节点跨度的长度, 为0则不使用
+	bool LM_LEFT_ESTIMATE = false;		//立方体剪枝排序时是否用语言模型的rest cost估计缺少完整上文的左边界词的得分
+	double COARSE_THRESHOLD = 3;		//由粗到精解码时, 粗搜索中最大边际得分比最好译文低该值以上的规则应用在精搜索中被剪掉
+	double SEN_TIME_BUDGET = 0;			//每个句子的解码时间预算(秒), 快用完时逐步缩小柱宽和规则数, 最后只用glue规则, 为0则不限制;
+										//这是软限制: 每个节点至少生成一个候选, 正在翻译的节点不会被中断, 实际用时可能略超预算
+	size_t THREAD_NUM = 0;				//翻译线程数, 所有句子的节点任务共用这些线程, 同时翻译的句子数也不超过该值
+	size_t SEN_THREAD_NUM = 1;			//已废弃, 只在没有THREAD-NUM时与SPAN_THREAD_NUM的乘积作为翻译线程数
+	size_t SPAN_THREAD_NUM = 1;			//已废弃, 同上
 	size_t NBEST_NUM;
 	size_t RULE_NUM_LIMIT;		      	//源端相同的情况下最多能加载的规则数
+	size_t LOAD_THREAD_NUM = 1;			//加载规则表的线程数
+	size_t RULE_CACHE_SIZE = 0;			//按需加载编译后规则表时的缓存大小(MB), 为0则映射整个规则表
+	size_t PROB_BITS = 0;				//规则翻译概率的量化位数, 可为0(不量化), 8或16
 	bool PRINT_NBEST;
 	bool DUMP_RULE;						//是否输出所使用的规则
 	bool LOAD_ALIGNMENT;				//加载短语表时是否加载短语内部的词对齐
+	bool RESCORE_RULE_TABLE = false;	//命令行参数-rescore-rule-table: 编译后规则表的权重与当前权重不同时在内存中重新打分
 };
 
 struct Weight
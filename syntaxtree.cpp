@@ -1,11 +1,12 @@
 #include "syntaxtree.h"
 
-SyntaxTree::SyntaxTree(const string &line_of_tree)
+SyntaxTree::SyntaxTree(const string &line_of_tree, RuleTable *ruletable)
 {
 	if (line_of_tree.size() > 3)
 	{
 		build_tree_from_str(line_of_tree);
 		update_attrib(root);
+		intern_labels(root,ruletable);
 	}
 	else
 	{
@@ -18,8 +19,8 @@ SyntaxTree::SyntaxTree(const string &line_of_tree)
 void SyntaxTree::build_tree_from_str(const string &line_of_tree)
 {
 	vector<string> toks = Split(line_of_tree);
-	SyntaxNode* cur_node;
-	SyntaxNode* pre_node;
+	SyntaxNode* cur_node = NULL;
+	SyntaxNode* pre_node = NULL;
 	int word_index = 0;
 	for(size_t i=0;i<toks.size();i++)
 	{
@@ -108,6 +109,16 @@ void SyntaxTree::update_attrib(SyntaxNode* node)
 	}
 }
 
+// 将每个节点的标签转换为规则表中的标签id, 规则匹配时只比较整数
+void SyntaxTree::intern_labels(SyntaxNode* node, RuleTable *ruletable)
+{
+	node->label_id = ruletable->find_label_id(node->label);
+	for (const auto child : node->children)
+	{
+		intern_labels(child,ruletable);
+	}
+}
+
 void SyntaxTree::dump(SyntaxNode* node)
 {
 	cout<<" ( "<<node->label<<' '<<node->span_lbound<<' '<<node->span_rbound<<' '<<node->type;
@@ -5,23 +5,38 @@
 #include "cand.h"
 #include "vocab.h"
 
+// 由粗到精解码时, 粗搜索之后该节点上保留下来的规则应用, 精搜索只在这些规则应用上做立方体剪枝
+struct CoarseSurvivors
+{
+	bool is_reached;                                 // 是否有被保留的候选等价类
+	map<pair<const RuleTrieNode*,int>,int> rule_limits; // 保留的规则组(规则源端Trie节点, 规则组序号), 以及组内使用的规则数(保留的最大规则排名加1)
+	unordered_set<size_t> cand_keys;                 // 保留的候选等价类, 由目标端根节点和译文哈希值得到
+	CoarseSurvivors() : is_reached(false) {}
+};
+
 // 源端句法树节点
 struct SyntaxNode
 {
 	string label;                                    // 该节点的句法标签或者词
+	int label_id;                                    // 该节点的标签在规则表中的标签id, 规则源端未出现过的为-1
 	SyntaxNode* father;
 	vector<SyntaxNode*> children;
 	int span_lbound;                                 // 该节点对应的span的左边界
 	int span_rbound;                                 // 该节点对应的span的右边界
 	NodeType type;                                   // 该节点的类型, 可为 1.单词节点; 2.词性节点; 3.句法节点
 	CandOrganizer cand_organizer;                    // 组织该节点的翻译候选
+	vector<RuleBlockPtr> rule_blocks;                // 按需加载规则时, 保证该节点的候选所引用的规则在句子翻译结束前有效
+	int unfinished_child_num;                        // 尚未生成候选的非词汇子节点的数量, 调度节点翻译顺序用
+	CoarseSurvivors coarse_survivors;                // 粗搜索之后保留的规则应用
 	
 	SyntaxNode ()
 	{
 		father      = NULL;
+		label_id    = -1;
 		span_lbound = 9999;
 		span_rbound = -1;
 		type        = WORD;
+		unfinished_child_num = 0;
 	}
 	~SyntaxNode ()
 	{
@@ -35,7 +50,7 @@ struct SyntaxNode
 class SyntaxTree
 {
 	public:
-		SyntaxTree(const string &line_of_tree);
+		SyntaxTree(const string &line_of_tree, RuleTable *ruletable);
 		~SyntaxTree()
 		{
 			delete root;
@@ -44,6 +59,7 @@ class SyntaxTree
 	private:
 		void build_tree_from_str(const string &line_of_tree);
 		void update_attrib(SyntaxNode* node);
+		void intern_labels(SyntaxNode* node, RuleTable *ruletable);
 		void dump(SyntaxNode* node);
 
 	public:
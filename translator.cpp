@@ -1,16 +1,26 @@
 #include "translator.h"
 
 SentenceTranslator::SentenceTranslator(const Models &i_models, const Parameter &i_para, const Weight &i_weight, const string &input_sen)
+	: sen_tgt_vocab(i_models.tgt_vocab)
 {
 	src_vocab = i_models.src_vocab;
 	tgt_vocab = i_models.tgt_vocab;
 	ruletable = i_models.ruletable;
 	lm_model = i_models.lm_model;
+	fine_lm_model = i_models.lm_model;
+	coarse_lm_model = i_models.coarse_lm_model;
+	is_fine_pass = false;
 	para = i_para;
 	feature_weight = i_weight;
 
-	src_tree = new SyntaxTree(input_sen);
+	src_tree = new SyntaxTree(input_sen,ruletable);
 	src_sen_len = src_tree->sen_len;
+	sen_tgt_vocab.map_sentence(src_tree->words);
+	pruned_cand_num = 0;
+	degraded_node_num = 0;
+	sen_start_time = 0;
+	pass_start_time = 0;
+	pass_budget = 0;
 }
 
 SentenceTranslator::~SentenceTranslator()
@@ -18,43 +28,71 @@ SentenceTranslator::~SentenceTranslator()
 	delete src_tree;
 }
 
-string SentenceTranslator::words_to_str(vector<int> &wids, bool drop_unk)
+// 回溯得到候选的译文, 并转换为字符串
+string SentenceTranslator::words_to_str(const Cand *cand, bool drop_unk)
 {
+		vector<int> wids;
+		wids.reserve(cand->tgt_len);
+		cand->get_tgt_wids(wids);
 		string output = "";
 		for (const auto &wid : wids)
 		{
-			string word = tgt_vocab->get_word(wid);
-			if (word != "NULL" || drop_unk == false)
+			if (wid != sen_tgt_vocab.null_id() || drop_unk == false)
 			{
-				output += word + " ";
+				output += sen_tgt_vocab.get_word(wid) + " ";
 			}
 		}
 		TrimLine(output);
 		return output;
 }
 
+// 从翻译森林中惰性抽取NBEST_NUM个最好的推导(包括被重组的候选), n-best列表的大小不受柱宽限制
 vector<TuneInfo> SentenceTranslator::get_tune_info(size_t sen_id)
 {
 	vector<TuneInfo> nbest_tune_info;
-	vector<Cand*> &final_cands = src_tree->root->cand_organizer.all_cands;
-	for (size_t i=0;i< min(final_cands.size(),(size_t)para.NBEST_NUM);i++)
+	if (src_sen_len == 0)
+		return nbest_tune_info;
+	KbestExtractor kbest_extractor(src_tree->root);
+	for (size_t i=0;i<para.NBEST_NUM;i++)
 	{
+		const Derivation *derivation = kbest_extractor.get_kth_best(i);
+		if (derivation == NULL)
+			break;
 		TuneInfo tune_info;
 		tune_info.sen_id = sen_id;
-		tune_info.translation = words_to_str(final_cands.at(i)->tgt_wids,false);
+		tune_info.translation = words_to_str(derivation->edge,false);                  // 同一等价类中所有推导的译文相同
 		for (size_t j=0;j<PROB_NUM;j++)
 		{
-			tune_info.feature_values.push_back(final_cands.at(i)->trans_probs.at(j));
+			tune_info.feature_values.push_back(derivation->trans_probs[j]);
 		}
-		tune_info.feature_values.push_back(final_cands.at(i)->lm_prob);
-		tune_info.feature_values.push_back(final_cands.at(i)->tgt_wids.size() );
-		tune_info.feature_values.push_back(final_cands.at(i)->rule_num);
-		tune_info.total_score = final_cands.at(i)->score;
+		tune_info.feature_values.push_back(derivation->lm_prob);
+		tune_info.feature_values.push_back(derivation->edge->tgt_len);
+		tune_info.feature_values.push_back(derivation->rule_num);
+		tune_info.total_score = derivation->score;
 		nbest_tune_info.push_back(tune_info);
 	}
 	return nbest_tune_info;
 }
 
+// 获取当前句子的翻译森林, 用于写入森林文件; 并检查用解码时的权重重新打分能否得到相同的超边得分,
+// 否则用原来的权重重打分森林时的译文会与解码结果不同
+void SentenceTranslator::get_forest(size_t sen_id, Forest &forest)
+{
+	forest.sen_id = sen_id;
+	if (src_sen_len == 0)
+		return;
+	ForestBuilder forest_builder(src_tree->root,&sen_tgt_vocab);
+	forest_builder.build(forest);
+	for (const auto &edge : forest.edges)
+	{
+		if (fabs(score_forest_edge(edge,feature_weight)-edge.score) > 1e-6)
+		{
+			cerr<<"warning: edge scores of sentence "<<sen_id<<" are not the weighted sum of its features\n";
+			break;
+		}
+	}
+}
+
 vector<string> SentenceTranslator::get_applied_rules(size_t sen_id)
 {
 	vector<string> applied_rules;
@@ -74,15 +112,15 @@ void SentenceTranslator::dump_rules(vector<string> &applied_rules, Cand *cand)
 	string applied_rule;
 	if (cand->type == OOV)
 	{
-		applied_rule = "OOV => " + tgt_vocab->get_word(cand->tgt_wids[0]) + "\n";
+		applied_rule = "OOV => " + sen_tgt_vocab.get_word(cand->oov_wid) + "\n";
 	}
 	else if (cand->type == GLUE)
 	{
 		applied_rule = "GLUE => ";
 		for (size_t i=0; i<cand->cand_rank_vec.size(); i++)
 		{
-			dump_rules(applied_rules, cand->cands_of_nt_leaves[i][cand->cand_rank_vec[i]]);
-			applied_rule += tgt_vocab->get_word( cand->cands_of_nt_leaves[i][cand->cand_rank_vec[i]]->tgt_root ) + " ";
+			dump_rules(applied_rules, (*cand->cands_of_nt_leaves)[i][cand->cand_rank_vec[i]]);
+			applied_rule += sen_tgt_vocab.get_word( (*cand->cands_of_nt_leaves)[i][cand->cand_rank_vec[i]]->tgt_root ) + " ";
 		}
 		applied_rule += "\n";
 	}
@@ -90,59 +128,260 @@ void SentenceTranslator::dump_rules(vector<string> &applied_rules, Cand *cand)
 	{
 		for (size_t i=0; i<cand->cand_rank_vec.size(); i++)
 		{
-			dump_rules(applied_rules, cand->cands_of_nt_leaves[i][cand->cand_rank_vec[i]]);
+			dump_rules(applied_rules, (*cand->cands_of_nt_leaves)[i][cand->cand_rank_vec[i]]);
 		}
-		RuleTrieNode *cur_rule_node = cand->rule_node;
+		const RuleTrieNode *cur_rule_node = cand->rule_node;
 		vector<string> src_rule;
-		while (cur_rule_node->father != NULL)
+		while (cur_rule_node->father() != NULL)
 		{
-			src_rule.push_back(cur_rule_node->rule_level_str);
-			cur_rule_node = cur_rule_node->father;
+			src_rule.push_back(src_vocab->get_word(cur_rule_node->rule_level_id));
+			cur_rule_node = cur_rule_node->father();
 		}
 		for (int i=src_rule.size()-1;i>=0;i--)
 		{
 			applied_rule += src_rule[i] + "\n";
 		}
 		applied_rule += "@@@\n";
-		TgtRule tgt_rule = cand->matched_tgt_rules->at(cand->rule_rank);
-		applied_rule += tgt_vocab->get_word(tgt_rule.tgt_root) + "\n";
-		for (auto wid : tgt_rule.tgt_leaves)
+		const TgtRule &tgt_rule = cand->matched_rule_group->rules()[cand->rule_rank];
+		applied_rule += sen_tgt_vocab.get_word(tgt_rule.tgt_root) + "\n";
+		for (int i=0; i<tgt_rule.leaf_num; i++)
 		{
-			applied_rule += tgt_vocab->get_word(wid) + " ";
+			applied_rule += sen_tgt_vocab.get_word(tgt_rule.tgt_leaves()[i]) + " ";
 		}
 		applied_rule += "\n";
-		for (auto aligned_pos : tgt_rule.aligned_src_positions)
+		for (int i=0; i<tgt_rule.leaf_num; i++)
 		{
-			applied_rule += to_string(aligned_pos) + " ";
+			applied_rule += to_string(tgt_rule.aligned_src_positions()[i]) + " ";
 		}
 		applied_rule += "\n";
 	}
 	applied_rules.push_back(applied_rule);
 }
 
-string SentenceTranslator::translate_sentence()
+/**************************************************************************************
+ 1. 函数功能: 开始翻译整个句子, 不等待翻译结束
+ 2. 入口参数: 句子翻译完成后调用的函数
+ 3. 出口参数: 无
+ 4. 算法简介: 给定低阶语言模型时做由粗到精解码: 先用低阶语言模型翻译整个句子, 根据得到的
+              翻译森林剪掉不太可能出现在好译文中的规则应用, 再用完整的语言模型只在保留下来的
+              规则应用上重新翻译; 每一遍搜索由根节点完成后的线程接着处理(见finish_pass),
+              句子任务本身不阻塞等待节点任务, 因此线程池中的线程总可以执行任何句子的节点任务
+              注意: on_finish可能在其它线程中调用, 并且可以删除本对象
+***************************************************************************************/
+void SentenceTranslator::translate_sentence(const function<void()> &on_finish)
+{
+	finish_callback = on_finish;
+	if (src_sen_len == 0)
+	{
+		finish_sentence();
+		return;
+	}
+	sen_start_time  = omp_get_wtime();
+	pass_start_time = sen_start_time;
+	pass_budget     = para.SEN_TIME_BUDGET;
+	if (coarse_lm_model != NULL)
+	{
+		lm_model    = coarse_lm_model;
+		pass_budget = para.SEN_TIME_BUDGET/2;                                     // 粗搜索最多使用一半的预算
+	}
+	translate_all_nodes();
+}
+
+// 最好候选的译文, 须在句子翻译完成后调用
+string SentenceTranslator::get_translation()
 {
 	if (src_sen_len == 0)
 		return "";
-	for (size_t span=0;span<src_sen_len;span++)
+	return words_to_str(src_tree->root->cand_organizer.all_cands[0],true);
+}
+
+// 一遍搜索完成: 粗搜索之后剪枝并开始精搜索, 否则句子翻译完成
+void SentenceTranslator::finish_pass()
+{
+	if (coarse_lm_model != NULL && !is_fine_pass)
+	{
+		prune_by_coarse_pass();
+		lm_model = fine_lm_model;
+		is_fine_pass = true;
+		pass_start_time = omp_get_wtime();
+		pass_budget     = para.SEN_TIME_BUDGET-(pass_start_time-sen_start_time);  // 精搜索使用句子剩余的预算
+		translate_all_nodes();
+		return;
+	}
+	finish_sentence();
+}
+
+// 调用完成回调; 回调可能删除本对象, 因此先复制到局部变量, 调用后不再访问任何成员
+void SentenceTranslator::finish_sentence()
+{
+	function<void()> on_finish = finish_callback;
+	on_finish();
+}
+
+/**************************************************************************************
+ 1. 函数功能: 为句法树的所有节点生成候选
+ 2. 入口参数: 无
+ 3. 出口参数: 无
+ 4. 算法简介: 按照依赖关系调度句法节点, 一个节点的所有子节点都生成候选之后该节点才可以翻译;
+              先为所有子节点都是词汇节点的节点创建任务, 其余节点由最后完成的子节点所在的线程继续翻译,
+              不同子树之间没有全局同步; 根节点完成后调用finish_pass, 本函数不等待节点任务结束
+***************************************************************************************/
+void SentenceTranslator::translate_all_nodes()
+{
+	vector<SyntaxNode*> ready_nodes;
+	init_node_schedule(src_tree->root,ready_nodes);
+	for (auto node : ready_nodes)
+	{
+#pragma omp task firstprivate(node)
+		translate_from_node(node);
+	}
+}
+
+/**************************************************************************************
+ 1. 函数功能: 根据粗搜索的翻译森林确定精搜索时每个节点保留的规则应用, 然后删除粗搜索的候选
+ 2. 入口参数: 无
+ 3. 出口参数: 无
+ 4. 算法简介: 超图节点为候选等价类, 超边为候选(包括被重组的候选); 超边的最大边际得分为
+              所在等价类的Viterbi外部得分加上该候选的得分, 比最好译文低COARSE_THRESHOLD
+              以内的超边被保留, 它们的尾节点等价类也被保留
+***************************************************************************************/
+void SentenceTranslator::prune_by_coarse_pass()
+{
+	unordered_map<const Cand*,const Cand*> cand_to_head;
+	map<pair<const Cand*,bool>,double> outside;                                            // 每个超图节点的Viterbi外部得分
+	index_recombined_classes(src_tree->root,cand_to_head);
+	for (auto head : src_tree->root->cand_organizer.all_cands)
+	{
+		outside[make_pair(head,false)] = 0.0;
+	}
+	double best_score = src_tree->root->cand_organizer.all_cands[0]->score;
+	collect_coarse_survivors(src_tree->root,cand_to_head,outside,best_score-para.COARSE_THRESHOLD);
+	clear_cands(src_tree->root);
+}
+
+// 先序遍历句法树, 祖先节点先于子孙节点处理, 因此处理一个节点时来自祖先节点的外部得分都已经确定.
+// 超图节点的划分与KbestExtractor相同: (等价类,false)包含等价类中所有超边, (等价类,true)只包含非一元规则超边;
+// 一元规则超边的尾节点为同一句法节点上的(等价类,true), 所以先处理一元规则超边, 再处理非一元规则超边, 不会形成环
+void SentenceTranslator::collect_coarse_survivors(SyntaxNode *node, unordered_map<const Cand*,const Cand*> &cand_to_head, map<pair<const Cand*,bool>,double> &outside, double min_score)
+{
+	if ( node->children.empty() )
+		return;
+	CoarseSurvivors &survivors = node->coarse_survivors;
+	const vector<Cand*> &heads = node->cand_organizer.all_cands;
+	for (auto head : heads)
 	{
-#pragma omp parallel for num_threads(para.SPAN_THREAD_NUM)
-		for(size_t beg=0;beg<src_sen_len-span;beg++)
+		auto it = outside.find(make_pair(head,false));
+		if ( it == outside.end() )
+			continue;
+		double head_outside = it->second;
+		for (const Cand *edge=head; edge!=NULL; edge=edge->next_recombined)
 		{
-			int end = beg + span;
-			auto it = src_tree->nodes_at_span.find((beg<<16) + end);
-			if ( it == src_tree->nodes_at_span.end() )
+			if (edge->is_unary == false || head_outside+edge->score < min_score)
 				continue;
-			else
+			keep_coarse_edge(survivors,head,edge);
+			update_outside(edge,0,head_outside,cand_to_head,outside);
+		}
+	}
+	for (auto head : heads)
+	{
+		double head_outside = -numeric_limits<double>::infinity();
+		for (bool non_unary_only : {false,true})
+		{
+			auto it = outside.find(make_pair(head,non_unary_only));
+			if ( it != outside.end() )
 			{
-				for (const auto &node : it->second)
-				{
-					generate_kbest_for_node(node);
-				}
+				head_outside = max(head_outside,it->second);
 			}
 		}
+		for (const Cand *edge=head; edge!=NULL; edge=edge->next_recombined)
+		{
+			if (edge->is_unary == true || head_outside+edge->score < min_score)
+				continue;
+			keep_coarse_edge(survivors,head,edge);
+			for (size_t i=0; i<edge->cand_rank_vec.size(); i++)
+			{
+				update_outside(edge,i,head_outside,cand_to_head,outside);
+			}
+		}
+	}
+	for (auto child : node->children)
+	{
+		collect_coarse_survivors(child,cand_to_head,outside,min_score);
+	}
+}
+
+// 保留一条超边: 记录它所在的等价类, 以及它所用的规则组和规则排名
+void SentenceTranslator::keep_coarse_edge(CoarseSurvivors &survivors, const Cand *head, const Cand *edge)
+{
+	survivors.is_reached = true;
+	survivors.cand_keys.insert(CandOrganizer::get_recombine_key(head));
+	if (edge->type == NORMAL)
+	{
+		int &rule_limit = survivors.rule_limits[make_pair(edge->rule_node,edge->rule_group_idx)];
+		rule_limit = max(rule_limit,edge->rule_rank+1);
+	}
+}
+
+// 用超边更新第tail_idx个尾节点的外部得分, 一元规则超边的尾节点只包含非一元规则超边
+void SentenceTranslator::update_outside(const Cand *edge, size_t tail_idx, double head_outside, unordered_map<const Cand*,const Cand*> &cand_to_head, map<pair<const Cand*,bool>,double> &outside)
+{
+	const Cand *tail_cand = (*edge->cands_of_nt_leaves)[tail_idx][edge->cand_rank_vec[tail_idx]];
+	double tail_outside = head_outside + edge->score - tail_cand->score;
+	auto result = outside.insert(make_pair(make_pair(cand_to_head[tail_cand],edge->is_unary),tail_outside));
+	if (result.second == false)
+	{
+		result.first->second = max(result.first->second,tail_outside);
+	}
+}
+
+void SentenceTranslator::clear_cands(SyntaxNode *node)
+{
+	node->cand_organizer.clear();
+	for (auto child : node->children)
+	{
+		clear_cands(child);
+	}
+}
+
+// 统计每个节点尚未翻译的非词汇子节点数量, 并收集可以直接翻译的节点
+void SentenceTranslator::init_node_schedule(SyntaxNode* node, vector<SyntaxNode*> &ready_nodes)
+{
+	node->unfinished_child_num = 0;
+	for (auto child : node->children)
+	{
+		if ( child->children.empty() )                                                     // 词汇节点不需要翻译
+			continue;
+		node->unfinished_child_num++;
+		init_node_schedule(child,ready_nodes);
+	}
+	if (node->unfinished_child_num == 0)
+	{
+		ready_nodes.push_back(node);
+	}
+}
+
+// 翻译当前节点, 如果它是父节点最后一个完成的子节点, 则在当前线程中继续翻译父节点;
+// 根节点完成后结束这一遍搜索, finish_pass可能删除本对象, 之后直接返回
+void SentenceTranslator::translate_from_node(SyntaxNode* node)
+{
+	while (node != NULL)
+	{
+		generate_kbest_for_node(node);
+		SyntaxNode *father = node->father;
+		if (father == NULL)
+		{
+			finish_pass();
+			return;
+		}
+		int unfinished_child_num;
+#pragma omp flush                                                                              // 保证父节点所在线程能看到当前节点的候选
+#pragma omp atomic capture
+		unfinished_child_num = --father->unfinished_child_num;
+		if (unfinished_child_num != 0)
+			break;
+#pragma omp flush
+		node = father;
 	}
-	return words_to_str(src_tree->root->cand_organizer.all_cands[0]->tgt_wids,true);
 }
 
 /**************************************************************************************
@@ -155,7 +394,16 @@ void SentenceTranslator::generate_kbest_for_node(SyntaxNode* node)
 {
 	if ( node->children.empty() )                                                          // 跳过词汇节点
 		return;
-	vector<RuleMatchInfo> rule_match_info_vec = find_matched_rules_for_syntax_node(node);  // 查找匹配的规则
+	SearchLimit limit = get_search_limit();
+	if (is_fine_pass && !node->coarse_survivors.is_reached)                               // 粗搜索中没有保留候选的节点只生成一个候选
+	{
+		limit.beam_size = 1;
+	}
+	vector<RuleMatchInfo> rule_match_info_vec;
+	if ( !limit.glue_only )                                                                // 只用glue规则时不再匹配规则, 词性节点按OOV处理
+	{
+		rule_match_info_vec = ruletable->find_matched_rules_for_syntax_node(node);        // 查找匹配的规则
+	}
 
 	if ( rule_match_info_vec.size()<=1 && node->type==POS )                                // 词性节点, 没有或者只有一个匹配到的规则(一元规则)
 	{
@@ -167,31 +415,66 @@ void SentenceTranslator::generate_kbest_for_node(SyntaxNode* node)
 		for (size_t i=1;i<rule_match_info_vec.size();i++)                                  // 遍历匹配上的普通规则(不包括一元规则)
 		{
 			RuleMatchInfo &rule_match_info = rule_match_info_vec[i];
-			if ( rule_match_info.rule_node->tgt_rules.empty() )                            // 跳过空Trie节点(没有规则目标端)
+			if ( rule_match_info.rule_node->group_num == 0 )                               // 跳过空Trie节点(没有规则目标端)
 				continue;
 			add_best_cand_to_pq_with_normal_rule(candpq,rule_match_info);                  // 根据(非一元)规则生成候选, 并加入candpq
 		}
-		if ( candpq.empty() )
+		if ( candpq.empty() && node->type == POS )                                         // 词性节点的规则都被粗搜索剪掉(粗搜索时已按OOV处理)
 		{
-			add_best_cand_to_pq_with_glue_rule(candpq,node);                               // 使用glue规则生成候选, 并加入candpq
+			add_cand_for_oov(node);
 		}
-		extend_cand_by_cube_pruning(candpq,node);                                          // 通过立方体剪枝对候选进行扩展
-
-		if ( !rule_match_info_vec.empty() && !rule_match_info_vec[0].rule_node->tgt_rules.empty() )
+		else if ( candpq.empty() )
 		{
-			extend_cand_with_unary_rule(rule_match_info_vec[0]);                           // 根据一元规则对候选进行扩展
+			add_best_cand_to_pq_with_glue_rule(candpq,node);                               // 使用glue规则生成候选, 并加入candpq
 		}
-		while ( !candpq.empty() )
+		extend_cand_by_cube_pruning(candpq,node,limit);                                    // 通过立方体剪枝对候选进行扩展
+
+		if ( !rule_match_info_vec.empty() && rule_match_info_vec[0].rule_node->group_num != 0 )
 		{
-			delete candpq.top();
-			candpq.pop();
+			extend_cand_with_unary_rule(rule_match_info_vec[0],limit);                     // 根据一元规则对候选进行扩展
 		}
 	}
 	node->cand_organizer.sort_and_group_cands();                                           // 对候选进行排序和分组
 	for (auto cand : node->cand_organizer.all_cands)
 	{
-		cand->syntax_node_info = node->label+"("+to_string(node->span_lbound)+","+to_string(node->span_rbound)+")";
+		cand->syntax_node = node;
+	}
+}
+
+/**************************************************************************************
+ 1. 函数功能: 根据当前这一遍搜索已用的时间确定下一个节点的搜索限制
+ 2. 入口参数: 无
+ 3. 出口参数: 搜索限制
+ 4. 算法简介: 这一遍的时间预算用掉一半之前不做限制; 之后柱宽和规则数随剩余时间线性缩小;
+              用掉80%之后只保留每个节点的一个候选, 不再匹配规则, 只用glue规则拼接子节点的候选,
+              保证剩余的节点能很快完成; 只有限制确实小于配置时才把节点计为缩小了搜索空间
+***************************************************************************************/
+SearchLimit SentenceTranslator::get_search_limit()
+{
+	SearchLimit limit = {para.BEAM_SIZE,(int)para.RULE_NUM_LIMIT,false};
+	if (para.SEN_TIME_BUDGET <= 0)
+		return limit;
+	double used = pass_budget > 0 ? (omp_get_wtime()-pass_start_time)/pass_budget : 1.0;
+	if (used < 0.5)
+		return limit;
+	if (used < 0.8)
+	{
+		double scale = (0.8-used)/0.3;
+		limit.beam_size      = max((size_t)1,(size_t)(para.BEAM_SIZE*scale));
+		limit.rule_num_limit = max(1,(int)(para.RULE_NUM_LIMIT*scale));
+	}
+	else
+	{
+		limit.beam_size      = 1;
+		limit.rule_num_limit = 1;
+		limit.glue_only      = true;
+	}
+	if (limit.beam_size < para.BEAM_SIZE || limit.rule_num_limit < (int)para.RULE_NUM_LIMIT || limit.glue_only)
+	{
+#pragma omp atomic
+		degraded_node_num++;
 	}
+	return limit;
 }
 
 /**************************************************************************************
@@ -202,19 +485,20 @@ void SentenceTranslator::generate_kbest_for_node(SyntaxNode* node)
 ***************************************************************************************/
 void SentenceTranslator::add_cand_for_oov(SyntaxNode *node)
 {
-	Cand *oov_cand = new Cand;
+	Cand *oov_cand = node->cand_organizer.new_cand();
 	oov_cand->type = OOV;
-	fill(oov_cand->trans_probs.begin(),oov_cand->trans_probs.end(),LogP_PseudoZero);
+	fill(oov_cand->trans_probs,oov_cand->trans_probs+PROB_NUM,LogP_PseudoZero);
 	for (const auto w : feature_weight.trans)
 	{
 		oov_cand->score += w*LogP_PseudoZero;
 	}
-	oov_cand->tgt_root     = tgt_vocab->get_id("NN");
-	//oov_cand->tgt_wids     = {tgt_vocab->get_id("NULL")};
-	oov_cand->tgt_wids     = {tgt_vocab->get_id(node->children[0]->label)};
+	oov_cand->tgt_root     = tgt_vocab->oov_root_id();
+	//oov_cand->oov_wid      = tgt_vocab->get_id("NULL");
+	oov_cand->oov_wid      = sen_tgt_vocab.word_id(node->span_lbound);
+	oov_cand->append_word(oov_cand->oov_wid);
 	oov_cand->rule_num     = 1;
 	oov_cand->lm_prob      = lm_model->cal_increased_lm_score(oov_cand);
-	oov_cand->score       += feature_weight.lm*oov_cand->lm_prob + feature_weight.rule_num*1;
+	oov_cand->score       += feature_weight.lm*oov_cand->lm_prob + feature_weight.len*1 + feature_weight.rule_num*1;
 	node->cand_organizer.add(oov_cand);
 }
 
@@ -227,34 +511,48 @@ void SentenceTranslator::add_cand_for_oov(SyntaxNode *node)
 void SentenceTranslator::add_best_cand_to_pq_with_normal_rule(Candpq &candpq, RuleMatchInfo &rule_match_info)
 {
 	vector<map<int, vector<Cand*> >* > cand_group_vec;                                   // 存储所有非终结符叶节点的候选分组表
+	vector<SyntaxNode*> nt_leaves;
 	for (const auto &syntax_leaf : rule_match_info.syntax_leaves)
 	{
 		if ( syntax_leaf->children.empty() )                                             // 若为词汇节点, 则跳过
 			continue;
 		map<int,vector<Cand*> > &cand_group = syntax_leaf->cand_organizer.tgt_root_to_cand_group;
 		cand_group_vec.push_back(&cand_group);
+		nt_leaves.push_back(syntax_leaf);
 	}
 
-	for (auto &kvp : rule_match_info.rule_node->tgt_rule_group)                          // 遍历规则目标端的分组
+	SyntaxNode *node = rule_match_info.syntax_root;
+	const RuleTrieNode *rule_node = rule_match_info.rule_node;
+	const RuleGroup *rule_groups = ruletable->get_rule_groups(rule_node,rule_match_info.syntax_root->rule_blocks);
+	CandLists *cands_of_nt_leaves = NULL;
+	for (const RuleGroup *rule_group=rule_groups; rule_group!=rule_groups+rule_node->group_num; rule_group++) // 遍历规则目标端的分组
 	{
-		TgtRule &best_tgt_rule = kvp.second[0];                                          // 取出每组规则中最好的
-		vector<vector<Cand*> > cands_of_nt_leaves;                                       // 存储规则源端非终结符叶节点的翻译候选
+		if ( ruletable->get_rule_num(rule_group) == 0 )                                  // 该组规则排名都在RULE_NUM_LIMIT之后
+			continue;
+		if ( is_coarse_restricted(node) && node->coarse_survivors.rule_limits.count(make_pair(rule_node,(int)(rule_group-rule_groups))) == 0 ) // 粗搜索中该组规则的超边都被剪掉
+			continue;
+		const TgtRule &best_tgt_rule = rule_group->rules()[0];                           // 取出每组规则中最好的
+		if (cands_of_nt_leaves == NULL)
+		{
+			cands_of_nt_leaves = node->cand_organizer.new_cand_lists();                  // 存储规则源端非终结符叶节点的翻译候选, 由该组规则生成的候选共享
+		}
+		cands_of_nt_leaves->clear();
 		bool is_match = true;
-		for (size_t i=0;i<best_tgt_rule.aligned_src_positions.size();i++)                // 遍历规则目标端的每一个叶节点
+		for (int i=0;i<best_tgt_rule.leaf_num;i++)                                       // 遍历规则目标端的每一个叶节点
 		{
-			int src_idx = best_tgt_rule.aligned_src_positions[i];                        // 该叶节点在规则源端对应的位置
+			int src_idx = best_tgt_rule.aligned_src_positions()[i];                      // 该叶节点在规则源端对应的位置
 																						 // TODO src_idx的值使用叶节点序号(此为非终结符序号)更方便
 			if (src_idx == -1)                                                           // 跳过终结符叶节点, 若全是终结符则cands_of_nt_leaves为空
 				continue;
-			auto it = cand_group_vec[src_idx]->find(best_tgt_rule.tgt_leaves[i]);
-			auto it_glue = cand_group_vec[src_idx]->find( tgt_vocab->get_id("X-X-X") );
+			auto it = cand_group_vec[src_idx]->find(best_tgt_rule.tgt_leaves()[i]);
+			auto it_glue = cand_group_vec[src_idx]->find( tgt_vocab->glue_id() );
 			if ( it != cand_group_vec[src_idx]->end() )                                  // 有能够匹配当前规则目标端非终结符叶节点的翻译候选
 			{
-				cands_of_nt_leaves.push_back(it->second);
+				push_leaf_cands(cands_of_nt_leaves,it->second,nt_leaves[src_idx],node);
 			}
 			else if ( it_glue != cand_group_vec[src_idx]->end() )                        // 没有匹配候选就使用glue候选 TODO 不应该用吧
 			{
-				cands_of_nt_leaves.push_back(it_glue->second);
+				push_leaf_cands(cands_of_nt_leaves,it_glue->second,nt_leaves[src_idx],node);
 			}
 			else
 			{
@@ -264,49 +562,68 @@ void SentenceTranslator::add_best_cand_to_pq_with_normal_rule(Candpq &candpq, Ru
 		}
 		if (is_match == true)
 		{
-			vector<int> rank_vec(cands_of_nt_leaves.size(),0);
-			Cand *cand = generate_cand_from_normal_rule(kvp.second,0,cands_of_nt_leaves,rank_vec); // 根据规则和叶节点候选生成当前节点的候选
+			IntList rank_vec(cands_of_nt_leaves->size(),0,node->cand_organizer.allocator());
+			Cand *cand = generate_cand_from_normal_rule(node,rule_group,0,cands_of_nt_leaves,rank_vec); // 根据规则和叶节点候选生成当前节点的候选
 			cand->rule_node = rule_match_info.rule_node;
+			cand->rule_group_idx = rule_group - rule_groups;
 			candpq.push(cand);
+			cands_of_nt_leaves = NULL;                                                   // 已被候选引用, 下一组规则重新分配
 		}
 	}
 }
 
+// 将叶节点的一组候选作为一个非终结符的候选列表; 精搜索时只使用粗搜索中被保留的等价类,
+// 一个都没有保留时使用全部候选
+void SentenceTranslator::push_leaf_cands(CandLists *cand_lists, const vector<Cand*> &leaf_cands, const SyntaxNode *leaf, SyntaxNode *node)
+{
+	cand_lists->push_back(CandList(node->cand_organizer.allocator()));
+	CandList &cand_list = cand_lists->back();
+	if ( is_coarse_restricted(leaf) )
+	{
+		for (auto cand : leaf_cands)
+		{
+			if ( leaf->coarse_survivors.cand_keys.count(CandOrganizer::get_recombine_key(cand)) != 0 )
+			{
+				cand_list.push_back(cand);
+			}
+		}
+	}
+	if ( cand_list.empty() )
+	{
+		cand_list.assign(leaf_cands.begin(),leaf_cands.end());
+	}
+}
+
 /**************************************************************************************
  1. 函数功能: 根据规则和规则目标端非终结符叶节点的翻译候选生成当前节点的候选
- 2. 入口参数: a) 非终结符叶节点相同的规则列表 b) 使用的规则在规则列表中的排名
-              c) 每个非终结符叶节点的翻译候选 d) 使用的每个翻译候选在它所在列表中的排名
+ 2. 入口参数: a) 当前句法节点 b) 非终结符叶节点相同的规则列表 c) 使用的规则在规则列表中的排名
+              d) 每个非终结符叶节点的翻译候选 e) 使用的每个翻译候选在它所在列表中的排名
  3. 出口参数: 指向新生成的候选的指针
  4. 算法简介: 见注释
 ***************************************************************************************/
-Cand* SentenceTranslator::generate_cand_from_normal_rule(vector<TgtRule> &tgt_rules,int rule_rank,vector<vector<Cand*> > &cands_of_nt_leaves, vector<int> &cand_rank_vec)
+Cand* SentenceTranslator::generate_cand_from_normal_rule(SyntaxNode *node,const RuleGroup *rule_group,int rule_rank,const CandLists *cands_of_nt_leaves,const IntList &cand_rank_vec)
 {
-	Cand *cand = new Cand;
+	Cand *cand = node->cand_organizer.new_cand();
 	cand->type = NORMAL;
-	// 记录当前候选的以下来源信息: 1) 使用的哪条规则; 2) 使用的每个非终结符叶节点中的哪个候选; 3) 使用的每个叶节点候选的目标端根节点id
-	cand->matched_tgt_rules  = &tgt_rules;
+	// 记录当前候选的以下来源信息: 1) 使用的哪条规则; 2) 使用的每个非终结符叶节点中的哪个候选
+	cand->matched_rule_group = rule_group;
 	cand->rule_rank          = rule_rank;
 	cand->cands_of_nt_leaves = cands_of_nt_leaves;
 	cand->cand_rank_vec      = cand_rank_vec;
-	for (size_t i=0; i<cands_of_nt_leaves.size(); i++)
-	{
-		cand->tgt_root_of_leaf_cands.push_back(cands_of_nt_leaves[i][cand_rank_vec[i]]->tgt_root);
-	}
-	
-	TgtRule &applied_rule = tgt_rules[rule_rank];
+	const TgtRule &applied_rule = rule_group->rules()[rule_rank];
 	cand->tgt_root        = applied_rule.tgt_root;                                                           // 更新当前候选的目标端根节点
-	cand->trans_probs     = applied_rule.probs;                                                              // 初始化当前候选的翻译概率
+	ruletable->get_probs(applied_rule,cand->trans_probs);                                                    // 初始化当前候选的翻译概率
 	size_t nt_idx         = 0;
-	for (size_t i=0; i<applied_rule.tgt_leaves.size(); i++)
+	for (int i=0; i<applied_rule.leaf_num; i++)
 	{
-		if (applied_rule.aligned_src_positions[i] == -1)
+		if (applied_rule.aligned_src_positions()[i] == -1)
 		{
-			cand->tgt_wids.push_back(applied_rule.tgt_leaves[i]);                                            // 将规则目标端的词加入当前候选的译文
+			cand->append_word(applied_rule.tgt_leaves()[i]);                                                     // 将规则目标端的词加入当前候选的译文
 		}
 		else
 		{
-			Cand* subcand = cands_of_nt_leaves[nt_idx][cand_rank_vec[nt_idx]];
-			cand->tgt_wids.insert( cand->tgt_wids.end(),subcand->tgt_wids.begin(),subcand->tgt_wids.end() ); // 加入规则目标端非终结符的译文
+			Cand* subcand = (*cands_of_nt_leaves)[nt_idx][cand_rank_vec[nt_idx]];
+			cand->append_cand(subcand);                                                                      // 加入规则目标端非终结符的译文(只更新长度和哈希值)
 			cand->rule_num  += subcand->rule_num;                                                            // 累加所用的规则数量
 			for (size_t j=0; j<PROB_NUM; j++)
 			{
@@ -322,9 +639,17 @@ Cand* SentenceTranslator::generate_cand_from_normal_rule(vector<TgtRule> &tgt_ru
 	cand->lm_prob   += increased_lm_score;
 	cand->score     += applied_rule.score + feature_weight.lm*increased_lm_score + feature_weight.len*applied_rule.word_num
                        + feature_weight.rule_num*1;
+	cand->heuristic_score = cand->score + feature_weight.lm*cal_left_estimate(cand);
 	return cand;
 }
 
+// 估计候选左边界词将来得到完整上文后语言模型得分的变化.
+// KenLM只用低阶n元语法为左状态中的词打分, 这些词在与左侧译文拼接时会被重新打分, 估计值由语言模型的rest cost得到
+double SentenceTranslator::cal_left_estimate(const Cand *cand)
+{
+	return para.LM_LEFT_ESTIMATE ? cand->lm_left_estimate : 0.0;
+}
+
 /**************************************************************************************
  1. 函数功能: 根据glue规则生成最优候选并加入candpq中
  2. 入口参数: 当前句法树节点
@@ -333,35 +658,34 @@ Cand* SentenceTranslator::generate_cand_from_normal_rule(vector<TgtRule> &tgt_ru
 ***************************************************************************************/
 void SentenceTranslator::add_best_cand_to_pq_with_glue_rule(Candpq &candpq,SyntaxNode* node)
 {
-	vector<vector<Cand*> > cands_of_leaves;                                        // 存储当前句法节点所有子节点的翻译候选
+	CandLists *cands_of_leaves = node->cand_organizer.new_cand_lists();           // 存储当前句法节点所有子节点的翻译候选, 由所有glue候选共享
 	for (auto &syntax_leaf : node->children)
 	{
-		cands_of_leaves.push_back(syntax_leaf->cand_organizer.all_cands);
+		push_leaf_cands(cands_of_leaves,syntax_leaf->cand_organizer.all_cands,syntax_leaf,node);
 	}
-	vector<int> cand_rank_vec(cands_of_leaves.size(),0);                           // 取每个子节点的最好候选
-	Cand *glue_cand = generate_cand_from_glue_rule(cands_of_leaves,cand_rank_vec); // 将子节点候选顺序拼接生前glue候选
+	IntList cand_rank_vec(cands_of_leaves->size(),0,node->cand_organizer.allocator()); // 取每个子节点的最好候选
+	Cand *glue_cand = generate_cand_from_glue_rule(node,cands_of_leaves,cand_rank_vec); // 将子节点候选顺序拼接生前glue候选
 	candpq.push(glue_cand);
 }
 
 /**************************************************************************************
  1. 函数功能: 根据glue规则和当前句法节点的所有子节点的翻译候选生成当前节点的候选
- 2. 入口参数: a) 当前句法节点的每个子节点的翻译候选列表 b) 使用的候选在所在列表中的排名
+ 2. 入口参数: a) 当前句法节点 b) 当前句法节点的每个子节点的翻译候选列表 c) 使用的候选在所在列表中的排名
  3. 出口参数: 指向新生成的候选的指针
  4. 算法简介: 将当前句法节点的所有子节点的翻译候选顺序拼接即可
 ***************************************************************************************/
-Cand* SentenceTranslator::generate_cand_from_glue_rule(vector<vector<Cand*> > &cands_of_leaves, vector<int> &cand_rank_vec)
+Cand* SentenceTranslator::generate_cand_from_glue_rule(SyntaxNode *node,const CandLists *cands_of_leaves,const IntList &cand_rank_vec)
 {
-	Cand *glue_cand = new Cand;
+	Cand *glue_cand = node->cand_organizer.new_cand();
 	glue_cand->type = GLUE;
 	glue_cand->cands_of_nt_leaves = cands_of_leaves;                                                               // 记录当每个叶节点的候选列表
 	glue_cand->cand_rank_vec      = cand_rank_vec;                                                                 // 记录所用候选在列表中的排名
-	glue_cand->tgt_root           = tgt_vocab->get_id("X-X-X");
+	glue_cand->tgt_root           = tgt_vocab->glue_id();
 
-	for (size_t i=0; i<cands_of_leaves.size(); i++)
+	for (size_t i=0; i<cands_of_leaves->size(); i++)
 	{
-		Cand *subcand = cands_of_leaves[i][cand_rank_vec[i]];
-		glue_cand->tgt_root_of_leaf_cands.push_back(subcand->tgt_root);                                            // 记录叶节点候选的根节点
-		glue_cand->tgt_wids.insert( glue_cand->tgt_wids.end(),subcand->tgt_wids.begin(),subcand->tgt_wids.end() ); // 顺序拼接叶节点译文
+		Cand *subcand = (*cands_of_leaves)[i][cand_rank_vec[i]];
+		glue_cand->append_cand(subcand);                                                                           // 顺序拼接叶节点译文
 		glue_cand->rule_num  += subcand->rule_num;                                                                 // 累加所用的规则数量
 		for (size_t j=0; j<PROB_NUM; j++)
 		{
@@ -374,6 +698,7 @@ Cand* SentenceTranslator::generate_cand_from_glue_rule(vector<vector<Cand*> > &c
 	glue_cand->lm_prob  += increased_lm_score;
 	glue_cand->rule_num +=  1;
 	glue_cand->score    += feature_weight.lm*increased_lm_score + feature_weight.rule_num*1;
+	glue_cand->heuristic_score = glue_cand->score + feature_weight.lm*cal_left_estimate(glue_cand);
 	return glue_cand;
 }
 
@@ -382,180 +707,160 @@ Cand* SentenceTranslator::generate_cand_from_glue_rule(vector<vector<Cand*> > &c
  2. 入口参数: 当前句法树节点
  3. 出口参数: 缓存当前节点翻译候选的candpq
  4. 算法简介: 每次取出candpq中的最好候选加入当前句法节点的cand_organizer, 然后最好候选的
-              邻居加入candpq
+              邻居加入candpq; 取出的候选数达到上限, 或者candpq中最好候选的排序得分比当前节点
+              第一个候选低BEAM_THRESHOLD以上时停止; 超出这一遍的时间预算时只保留已取出的候选
 ***************************************************************************************/
-void SentenceTranslator::extend_cand_by_cube_pruning(Candpq &candpq, SyntaxNode* node)
+void SentenceTranslator::extend_cand_by_cube_pruning(Candpq &candpq, SyntaxNode* node, const SearchLimit &limit)
 {
-	set<vector<int> > duplicate_set;
-	for (size_t i=0; i<para.BEAM_SIZE;i++)
+	static thread_local CubeKeySet duplicate_set;                                 // 每个线程一个, 在句法节点之间反复使用
+	duplicate_set.clear();
+	size_t beam_size = limit.beam_size;
+	if (para.BEAM_SIZE_PER_WORD > 0)                                              // 候选数上限随跨度长度增长
+	{
+		size_t span_len = node->span_rbound - node->span_lbound + 1;
+		beam_size = min(beam_size,para.BEAM_SIZE_PER_WORD*span_len);
+	}
+	double best_score = candpq.empty() ? 0.0 : candpq.top()->heuristic_score;
+	for (size_t i=0; i<beam_size;i++)
 	{
 		if (candpq.empty())
 			break;
-		Cand *best_cand = candpq.top();
-		candpq.pop();
-		add_neighbours_to_pq(candpq,best_cand,duplicate_set);
-		bool flag = node->cand_organizer.add(best_cand);
-		if (flag == false)
+		if (para.BEAM_THRESHOLD > 0 && candpq.top()->heuristic_score < best_score-para.BEAM_THRESHOLD)
+		{
+#pragma omp atomic
+			pruned_cand_num += candpq.size();                                     // 剩余的候选都被阈值剪掉
+			break;
+		}
+		if (i > 0 && para.SEN_TIME_BUDGET > 0 && omp_get_wtime()-pass_start_time > pass_budget)  // 至少保留一个候选
 		{
-			delete best_cand;
+#pragma omp atomic
+			degraded_node_num++;
+			break;
 		}
+		Cand *best_cand = candpq.top();
+		candpq.pop();
+		add_neighbours_to_pq(candpq,node,best_cand,duplicate_set,limit.rule_num_limit);
+		node->cand_organizer.add(best_cand);                                      // 被丢弃的候选随句法节点的内存池一起释放
 	}
 }
 
 /**************************************************************************************
  1. 函数功能: 将当前候选的邻居加入candpq中
- 2. 入口参数: 当前候选, 检查是否重复扩展的duplicate_set
+ 2. 入口参数: 当前句法节点, 当前候选, 检查是否重复扩展的duplicate_set, 每组规则最多使用的规则数
  3. 出口参数: 更新后的candpq
  4. 算法简介: a) 对于glue规则生成的候选, 考虑它所有非终结符叶节点的下一位候选
               b) 对于普通规则生成的候选, 考虑叶节点候选的下一位以及规则的下一位
+              先检查邻居的键是否重复, 不重复时才复制排名向量并生成候选
 ***************************************************************************************/
-void SentenceTranslator::add_neighbours_to_pq(Candpq &candpq, Cand* cur_cand, set<vector<int> > &duplicate_set)
+void SentenceTranslator::add_neighbours_to_pq(Candpq &candpq, SyntaxNode* node, Cand* cur_cand, CubeKeySet &duplicate_set, int rule_num_limit)
 {
-	vector<int> base_key;
-	base_key.push_back(cur_cand->tgt_root);
-	base_key.insert(base_key.end(),cur_cand->tgt_root_of_leaf_cands.begin(),cur_cand->tgt_root_of_leaf_cands.end());
     // 遍历所有非终结符叶节点, 若候选所用规则目标端无非终结符则不会进入此循环
-	for (size_t i=0; i<cur_cand->cands_of_nt_leaves.size(); i++)
+	for (size_t i=0; i<cur_cand->cands_of_nt_leaves->size(); i++)
 	{
-		if ( cur_cand->cand_rank_vec[i]+1 < cur_cand->cands_of_nt_leaves[i].size() )
+		if ( (size_t)cur_cand->cand_rank_vec[i]+1 < (*cur_cand->cands_of_nt_leaves)[i].size() )
 		{
-			vector<int> new_cand_rank_vec = cur_cand->cand_rank_vec;
-			new_cand_rank_vec[i]++;                        // 考虑当前非终结符叶节点候选的下一位
-			vector<int> new_key = base_key;
-			if (cur_cand->type == NORMAL)
-			{
-				new_key.push_back(cur_cand->rule_rank);
-			}
-			new_key.insert( new_key.end(),new_cand_rank_vec.begin(),new_cand_rank_vec.end() );
-			if (duplicate_set.count(new_key) == 0)
+			add_cube_key(duplicate_set,cur_cand,cur_cand->rule_rank,i);  // 考虑当前非终结符叶节点候选的下一位
+			if ( duplicate_set.insert_key() )
 			{
+				IntList new_cand_rank_vec = cur_cand->cand_rank_vec;
+				new_cand_rank_vec[i]++;
 				Cand *new_cand;
 				if (cur_cand->type == NORMAL)              // 普通规则生成的候选
 				{
-					new_cand = generate_cand_from_normal_rule(*(cur_cand->matched_tgt_rules),cur_cand->rule_rank,cur_cand->cands_of_nt_leaves,new_cand_rank_vec);
+					new_cand = generate_cand_from_normal_rule(node,cur_cand->matched_rule_group,cur_cand->rule_rank,cur_cand->cands_of_nt_leaves,new_cand_rank_vec);
 					new_cand->rule_node = cur_cand->rule_node;
+					new_cand->rule_group_idx = cur_cand->rule_group_idx;
 				}
 				else if (cur_cand->type == GLUE)          // glue规则生成的候选
 				{
-					new_cand = generate_cand_from_glue_rule(cur_cand->cands_of_nt_leaves,new_cand_rank_vec);
+					new_cand = generate_cand_from_glue_rule(node,cur_cand->cands_of_nt_leaves,new_cand_rank_vec);
 				}
 				candpq.push(new_cand);
-				duplicate_set.insert(new_key);
 			}
 		}
 	}
     // 对普通规则生成的候选, 考虑规则的下一位
-	if ( cur_cand->type == NORMAL && cur_cand->rule_rank+1<cur_cand->matched_tgt_rules->size() )
+	if ( cur_cand->type == NORMAL && is_coarse_restricted(node) )
+	{
+		auto it = node->coarse_survivors.rule_limits.find(make_pair(cur_cand->rule_node,cur_cand->rule_group_idx));
+		rule_num_limit = it == node->coarse_survivors.rule_limits.end() ? 0 : min(rule_num_limit,it->second);
+	}
+	if ( cur_cand->type == NORMAL && cur_cand->rule_rank+1<min(ruletable->get_rule_num(cur_cand->matched_rule_group),rule_num_limit) )
 	{
-		vector<int> new_key = base_key;
-		new_key.push_back(cur_cand->rule_rank+1);
-		new_key.insert( new_key.end(),cur_cand->cand_rank_vec.begin(),cur_cand->cand_rank_vec.end() );
-		if (duplicate_set.count(new_key) == 0)
+		add_cube_key(duplicate_set,cur_cand,cur_cand->rule_rank+1,-1);
+		if ( duplicate_set.insert_key() )
 		{
-			Cand *new_cand = generate_cand_from_normal_rule(*(cur_cand->matched_tgt_rules),cur_cand->rule_rank+1,cur_cand->cands_of_nt_leaves,cur_cand->cand_rank_vec);
+			Cand *new_cand = generate_cand_from_normal_rule(node,cur_cand->matched_rule_group,cur_cand->rule_rank+1,cur_cand->cands_of_nt_leaves,cur_cand->cand_rank_vec);
 			new_cand->rule_node = cur_cand->rule_node;
+			new_cand->rule_group_idx = cur_cand->rule_group_idx;
 			candpq.push(new_cand);
-			duplicate_set.insert(new_key);
 		}
 	}
 }
 
+// 在duplicate_set中构造邻居的键: 立方体的标识, 规则排名, 叶节点候选的排名(第inc_idx位加1);
+// 同一立方体(一组规则或glue规则)生成的候选共享同一个cands_of_nt_leaves, 因此用它的地址标识立方体,
+// 规则节点, 规则组以及叶节点候选的根节点都由立方体决定, 不必写入键中.
+// 排名的个数等于非终结符叶节点数, 对glue规则即子节点数, 没有上限, 因而键是变长的; 键的长度由立方体决定,
+// 立方体标识相同的两个键长度必然相同, 逐位比较即可保证不同的候选不会被误判为重复
+void SentenceTranslator::add_cube_key(CubeKeySet &duplicate_set, const Cand *cand, int rule_rank, int inc_idx)
+{
+	assert(cand->cand_rank_vec.size() == cand->cands_of_nt_leaves->size());   // 键的长度只由立方体决定
+	uint64_t cube_id = (uint64_t)(uintptr_t)cand->cands_of_nt_leaves;
+	duplicate_set.new_key();
+	duplicate_set.push((int)(cube_id&0xffffffff));
+	duplicate_set.push((int)(cube_id>>32));
+	duplicate_set.push(rule_rank);
+	for (int i=0; i<(int)cand->cand_rank_vec.size(); i++)
+	{
+		duplicate_set.push(cand->cand_rank_vec[i] + (i==inc_idx?1:0));
+	}
+}
+
 /**************************************************************************************
  1. 函数功能: 根据一元规则为当前句法节点生成更多候选
- 2. 入口参数: 一元规则的匹配信息
+ 2. 入口参数: 一元规则的匹配信息, 当前节点的搜索限制
  3. 出口参数: 无
  4. 算法简介: 将一元规则两端的词汇加到已有候选两端生成新的候选, 
-              并加入当前句法节点的cand_organizer中
+              并加入当前句法节点的cand_organizer中;
+              只用glue规则时不使用一元规则, 每组一元规则最多使用rule_num_limit条
 ***************************************************************************************/
-void SentenceTranslator::extend_cand_with_unary_rule(RuleMatchInfo &rule_match_info)
+void SentenceTranslator::extend_cand_with_unary_rule(RuleMatchInfo &rule_match_info, const SearchLimit &limit)
 {
+	if ( limit.glue_only )
+		return;
 	vector<Cand*> old_cands = rule_match_info.syntax_root->cand_organizer.all_cands;
+	const RuleGroup *rule_groups = ruletable->get_rule_groups(rule_match_info.rule_node,rule_match_info.syntax_root->rule_blocks);
 	for (auto cand : old_cands)                                                   // 遍历已有的候选
 	{
 		if ( cand->type == GLUE )                                                 // 跳过glue规则生成的候选
 			continue;
 		vector<int> tgt_root_id = {cand->tgt_root,0};
-		auto it = rule_match_info.rule_node->tgt_rule_group.find(tgt_root_id);    // 查找一元规则是否有匹配的目标端
-		if ( it == rule_match_info.rule_node->tgt_rule_group.end() )
+		const RuleGroup *rule_group = ruletable->find_group(rule_groups,rule_match_info.rule_node->group_num,tgt_root_id); // 查找一元规则是否有匹配的目标端
+		if ( rule_group == NULL )
 			continue;
-		vector<TgtRule> &tgt_rules = it->second;
-		vector<vector<Cand*> > cands_of_nt_leaves = {{cand}};
-		vector<int> cand_rank_vec = {0};
-		for (size_t rule_rank=0;rule_rank<tgt_rules.size();rule_rank++)
+		SyntaxNode *node = rule_match_info.syntax_root;
+		int rule_num = min(ruletable->get_rule_num(rule_group),limit.rule_num_limit);
+		if ( is_coarse_restricted(node) )                                         // 精搜索只使用粗搜索中保留的一元规则
 		{
-			Cand *new_cand = generate_cand_from_normal_rule(tgt_rules,rule_rank,cands_of_nt_leaves,cand_rank_vec);
-			new_cand->rule_node = rule_match_info.rule_node;
-			bool flag = rule_match_info.syntax_root->cand_organizer.add(new_cand);
-			if (flag == false)
-			{
-				delete new_cand;
-			}
-		}
-	}
-}
-
-/**************************************************************************************
- 1. 函数功能: 获取当前句法节点匹配到的所有规则
- 2. 入口参数: 当前句法节点的指针
- 3. 出口参数: 所有匹配上的规则
- 4. 算法简介: 按层遍历规则Trie树, 对于每一层中的每一条匹配上的规则, 考察它的下一层规则
-************************************************************************************* */
-vector<RuleMatchInfo> SentenceTranslator::find_matched_rules_for_syntax_node(SyntaxNode* cur_node)
-{
-	vector<RuleMatchInfo> match_info_vec;
-	auto it = ruletable->get_root()->subtrie_map.find(cur_node->label);
-	if ( it==ruletable->get_root()->subtrie_map.end())                     // 没找到可用的规则, 此处不必要求Trie节点包含规则目标端, 以便进行扩展
-		return match_info_vec;
-	RuleMatchInfo root_rule = {it->second,cur_node,{cur_node}};            // 一元规则, 即规则源端只含一个根节点
-	match_info_vec.push_back(root_rule);
-	size_t last_beg = 0, last_end = match_info_vec.size();                 // 记录规则Trie树当前层匹配上的规则在match_info_vec中的起始和终止位置
-	while(last_beg != last_end)
-	{
-		for (size_t cur_pos=last_beg; cur_pos!=last_end; cur_pos++)        // 对当前层匹配上的规则进行扩展
-		{
-			push_matched_rules_at_next_level(match_info_vec,cur_pos);
+			auto it = node->coarse_survivors.rule_limits.find(make_pair(rule_match_info.rule_node,(int)(rule_group-rule_groups)));
+			if ( it == node->coarse_survivors.rule_limits.end() )
+				continue;
+			rule_num = min(rule_num,it->second);
 		}
-		last_beg = last_end;
-		last_end = match_info_vec.size();
-	}
-	return match_info_vec;
-}
-
-/**************************************************************************************
- 1. 函数功能: 考察当前匹配上的规则的下一层规则, 将能匹配上的加入match_info_vec
- 2. 入口参数: 当前匹配上的规则在match_info_vec中的位置
- 3. 出口参数: 记录所有匹配规则的match_info_vec
- 4. 算法简介: 遍历下一层规则, 将每条规则的源端与句法树节点进行对比, 看能否匹配上
-***************************************************************************************/
-void SentenceTranslator::push_matched_rules_at_next_level(vector<RuleMatchInfo> &match_info_vec, size_t cur_pos)
-{
-	RuleMatchInfo cur_match_info = match_info_vec.at(cur_pos);                     // 此处不能用引用, 因为match_info_vec会因扩容而改变地址
-	for (auto &kvp : cur_match_info.rule_node->subtrie_map)
-	{
-		vector<string> nodes_vec = Split(kvp.first,"|||");                         // 记录当前规则源端每个叶节点扩展出来的节点
-		vector<SyntaxNode*> new_leaves;
-		RuleMatchInfo new_match_info;
-		for(size_t i=0; i<cur_match_info.syntax_leaves.size(); i++)
+		if ( rule_num <= 0 )
+			continue;
+		CandLists *cands_of_nt_leaves = node->cand_organizer.new_cand_lists();     // 由该候选扩展出的所有一元规则候选共享
+		cands_of_nt_leaves->push_back(CandList(1,cand,node->cand_organizer.allocator()));
+		IntList cand_rank_vec(1,0,node->cand_organizer.allocator());
+		for (int rule_rank=0;rule_rank<rule_num;rule_rank++)
 		{
-			if(nodes_vec[i] == "~")                                                // 该节点不进行扩展, 直接将原规则的叶节点作为新规则的叶节点
-			{
-				new_leaves.push_back(cur_match_info.syntax_leaves[i]);
-				continue;
-			}
-			vector<string> nodes = Split(nodes_vec[i]);                            // 记录规则源端一个叶节点扩展出来的节点
-			if( nodes.size() != cur_match_info.syntax_leaves[i]->children.size() ) // 规则源端叶节点与对应的句法树叶节点扩展出来的节点数不同
-				goto unmatch;
-			for(int j=0; j<nodes.size(); j++)                                      // 对规则源端叶节点与对应的句法树叶节点扩展出来的节点进行匹配
-			{
-				if (nodes[j] != cur_match_info.syntax_leaves[i]->children[j]->label)
-					goto unmatch;
-			}
-			vector<SyntaxNode*> &leaves_of_cur_child = cur_match_info.syntax_leaves[i]->children;
-			new_leaves.insert(new_leaves.end(), leaves_of_cur_child.begin(), leaves_of_cur_child.end());
+			Cand *new_cand = generate_cand_from_normal_rule(node,rule_group,rule_rank,cands_of_nt_leaves,cand_rank_vec);
+			new_cand->rule_node = rule_match_info.rule_node;
+			new_cand->rule_group_idx = rule_group - rule_groups;
+			new_cand->is_unary  = true;
+			node->cand_organizer.add(new_cand);
 		}
-		new_match_info = {kvp.second,cur_match_info.syntax_root,new_leaves};
-		match_info_vec.push_back(new_match_info);
-unmatch:;
 	}
 }
 
@@ -5,6 +5,7 @@
 #include "syntaxtree.h"
 #include "lm.h"
 #include "myutils.h"
+#include "kbest.h"
 
 struct Models
 {
@@ -12,14 +13,15 @@ struct Models
 	Vocab *tgt_vocab;
 	RuleTable *ruletable;
 	LanguageModel *lm_model;
+	LanguageModel *coarse_lm_model;                  // 粗搜索用的低阶语言模型, 不使用由粗到精解码时为NULL
 };
 
-// 记录规则匹配信息, 包括规则Trie树的节点, 以及输入句子句法树片段的头节点和叶子节点等信息
-struct RuleMatchInfo
+// 一个句法节点的搜索限制, 句子的时间预算快用完时逐步收紧
+struct SearchLimit
 {
-	RuleTrieNode* rule_node;
-	SyntaxNode* syntax_root;
-	vector<SyntaxNode*> syntax_leaves;
+	size_t beam_size;                                // 该节点最多取出的候选数
+	int rule_num_limit;                              // 每组规则最多使用的规则数
+	bool glue_only;                                  // 不匹配规则, 只用glue规则拼接子节点的候选(词性节点按OOV处理)
 };
 
 class SentenceTranslator
@@ -27,33 +29,60 @@ class SentenceTranslator
 	public:
 		SentenceTranslator(const Models &i_models, const Parameter &i_para, const Weight &i_weight, const string &input_sen);
 		~SentenceTranslator();
-		string translate_sentence();
+		void translate_sentence(const function<void()> &on_finish);
+		string get_translation();
 		vector<TuneInfo> get_tune_info(size_t sen_id);
 		vector<string> get_applied_rules(size_t sen_id);
+		void get_forest(size_t sen_id, Forest &forest);
+		size_t get_pruned_cand_num() {return pruned_cand_num;}
+		bool is_degraded() {return degraded_node_num > 0;}     // 是否因为超出时间预算而缩小了搜索空间
 	private:
+		void translate_all_nodes();
+		void finish_pass();
+		void finish_sentence();
+		void init_node_schedule(SyntaxNode* node, vector<SyntaxNode*> &ready_nodes);
+		void prune_by_coarse_pass();
+		void collect_coarse_survivors(SyntaxNode *node, unordered_map<const Cand*,const Cand*> &cand_to_head, map<pair<const Cand*,bool>,double> &outside, double min_score);
+		void keep_coarse_edge(CoarseSurvivors &survivors, const Cand *head, const Cand *edge);
+		void update_outside(const Cand *edge, size_t tail_idx, double head_outside, unordered_map<const Cand*,const Cand*> &cand_to_head, map<pair<const Cand*,bool>,double> &outside);
+		void clear_cands(SyntaxNode *node);
+		bool is_coarse_restricted(const SyntaxNode *node) {return is_fine_pass && node->coarse_survivors.is_reached;}
+		void push_leaf_cands(CandLists *cand_lists, const vector<Cand*> &leaf_cands, const SyntaxNode *leaf, SyntaxNode *node);
+		void translate_from_node(SyntaxNode* node);
 		void generate_kbest_for_node(SyntaxNode* node);
+		SearchLimit get_search_limit();
 		void add_cand_for_oov(SyntaxNode *node);
 		void add_best_cand_to_pq_with_normal_rule(Candpq &candpq, RuleMatchInfo &rule_match_info);
-		Cand* generate_cand_from_normal_rule(vector<TgtRule> &tgt_rules,int rule_rank,vector<vector<Cand*> > &cands_of_leaves,vector<int> &cand_rank_vec);
+		Cand* generate_cand_from_normal_rule(SyntaxNode *node,const RuleGroup *rule_group,int rule_rank,const CandLists *cands_of_leaves,const IntList &cand_rank_vec);
+		double cal_left_estimate(const Cand *cand);
 		void add_best_cand_to_pq_with_glue_rule(Candpq &candpq,SyntaxNode* node);
-		Cand* generate_cand_from_glue_rule(vector<vector<Cand*> > &cands_of_leaves, vector<int> &cand_rank_vec);
-		void extend_cand_by_cube_pruning(Candpq &candpq,SyntaxNode* node);
-		void add_neighbours_to_pq(Candpq &candpq, Cand* cur_cand, set<vector<int> > &duplicate_set);
-		void extend_cand_with_unary_rule(RuleMatchInfo &rule_match_info);
+		Cand* generate_cand_from_glue_rule(SyntaxNode *node,const CandLists *cands_of_leaves,const IntList &cand_rank_vec);
+		void extend_cand_by_cube_pruning(Candpq &candpq,SyntaxNode* node,const SearchLimit &limit);
+		void add_neighbours_to_pq(Candpq &candpq, SyntaxNode* node, Cand* cur_cand, CubeKeySet &duplicate_set, int rule_num_limit);
+		void add_cube_key(CubeKeySet &duplicate_set, const Cand *cand, int rule_rank, int inc_idx);
+		void extend_cand_with_unary_rule(RuleMatchInfo &rule_match_info, const SearchLimit &limit);
 		void dump_rules(vector<string> &applied_rules, Cand *cand);
-		string words_to_str(vector<int> &wids, bool drop_unk);
+		string words_to_str(const Cand *cand, bool drop_unk);
 
-		vector<RuleMatchInfo> find_matched_rules_for_syntax_node(SyntaxNode* cur_node);
-		void push_matched_rules_at_next_level(vector<RuleMatchInfo> &match_info_vec, size_t cur_pos);
 
 	private:
 		Vocab *src_vocab;
 		Vocab *tgt_vocab;
 		RuleTable *ruletable;
-		LanguageModel *lm_model;
+		LanguageModel *lm_model;                     // 当前这一遍搜索使用的语言模型
+		LanguageModel *fine_lm_model;
+		LanguageModel *coarse_lm_model;
+		bool is_fine_pass;                           // 是否为由粗到精解码的第二遍(精)搜索
 		Parameter para;
 		Weight feature_weight;
 
+		SentenceVocab sen_tgt_vocab;                 // 当前句子的目标端单词表, 包括源端OOV
 		SyntaxTree* src_tree;
 		size_t src_sen_len;
+		size_t pruned_cand_num;                      // 被BEAM_THRESHOLD剪掉的候选数量, 多个节点任务同时更新
+		double sen_start_time;                       // 开始翻译句子的时间, 由omp_get_wtime获得
+		double pass_start_time;                      // 开始当前这一遍搜索的时间
+		double pass_budget;                          // 当前这一遍搜索的时间预算: 粗搜索为SEN_TIME_BUDGET的一半, 精搜索为剩余的部分
+		int degraded_node_num;                       // 因时间预算缩小了搜索空间的节点数量, 多个节点任务同时更新
+		function<void()> finish_callback;            // 句子翻译完成后调用
 };
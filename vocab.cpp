@@ -19,19 +19,65 @@ void Vocab::load_vocab(const string &vocab_file)
 	}
 }
 
-int Vocab::get_id(const string &word)
+int Vocab::get_id(const string &word) const
 {
 	auto it=word2id.find(word);
 	if (it != word2id.end())
-	{
 		return it->second;
-	}
-	else
+	return -1;
+}
+
+int Vocab::add_word(const string &word)
+{
+	auto it=word2id.find(word);
+	if (it != word2id.end())
+		return it->second;
+	if (is_frozen)
 	{
-		int id = word_list.size();
-		word2id.insert(make_pair(word,id));
-		word_list.push_back(word);
+		cerr<<"cannot add word "<<word<<" to a frozen vocab!\n";
+		return -1;
+	}
+	int id = word_list.size();
+	word2id.insert(make_pair(word,id));
+	word_list.push_back(word);
+	return id;
+}
+
+// 添加解码用到的特殊符号并缓存它们的id, 之后单词表不再修改
+void Vocab::freeze()
+{
+	glue_wid     = add_word("X-X-X");
+	oov_root_wid = add_word("NN");
+	null_wid     = add_word("NULL");
+	is_frozen    = true;
+}
+
+/************************************************************************
+ 1. 函数功能: 获取单词在当前句子中的id
+ 2. 入口参数: 单词
+ 3. 出口参数: 单词的id
+ 4. 算法简介: 先查冻结的单词表; 不在表中的单词在句子内顺序查找, 一个句子
+              的OOV很少, 不需要哈希表
+ * **********************************************************************/
+int SentenceVocab::get_id(const string &word)
+{
+	int id = vocab->get_id(word);
+	if (id != -1)
 		return id;
+	for (size_t i=0; i<oov_words.size(); i++)
+	{
+		if (oov_words[i] == word)
+			return vocab->size()+i;
 	}
+	oov_words.push_back(word);
+	return vocab->size()+oov_words.size()-1;
 }
 
+void SentenceVocab::map_sentence(const vector<string> &words)
+{
+	word_wids.clear();
+	for (const auto &word : words)
+	{
+		word_wids.push_back(get_id(word));
+	}
+}
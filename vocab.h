@@ -4,17 +4,46 @@
 #include "stdafx.h"
 #include "myutils.h"
 
+// 加载阶段可以通过add_word添加单词(如语言模型中的单词), 调用freeze之后单词表只读, 多个线程可以同时查询
 class Vocab
 {
 	public:
-		Vocab(const string &vocab_file) {load_vocab(vocab_file);};
-		string get_word(int id){return word_list.at(id);};
-		int get_id(const string &word);
+		Vocab(const string &vocab_file) {is_frozen = false; load_vocab(vocab_file);};
+		const string& get_word(int id) const {return word_list.at(id);};
+		int get_id(const string &word) const;                  // 单词不在表中时返回-1
+		int add_word(const string &word);
+		void freeze();
+		int size() const {return word_list.size();};
+		int glue_id() const {return glue_wid;};                // 胶水规则的根节点X-X-X
+		int oov_root_id() const {return oov_root_wid;};        // OOV候选的根节点NN
+		int null_id() const {return null_wid;};                // 空译文NULL
 	private:
 		void load_vocab(const string &vocab_file);
 	private:
 		vector<string> word_list;
 		unordered_map<string,int> word2id;
+		bool is_frozen;
+		int glue_wid;
+		int oov_root_wid;
+		int null_wid;
+};
+
+// 句子内的OOV单词表, 不在冻结的单词表中的源端单词依次分配单词表大小之后的id
+// 解码前由map_sentence一次性查好句子中每个词的id, 解码时多个节点任务只读, 无需加锁
+class SentenceVocab
+{
+	public:
+		SentenceVocab(const Vocab *i_vocab) : vocab(i_vocab) {}
+		void map_sentence(const vector<string> &words);
+		int word_id(int pos) const {return word_wids.at(pos);};  // 源端第pos个词作为译文时的id
+		const string& get_word(int id) const {return id < vocab->size() ? vocab->get_word(id) : oov_words.at(id-vocab->size());};
+		int null_id() const {return vocab->null_id();};
+	private:
+		int get_id(const string &word);
+	private:
+		const Vocab *vocab;
+		vector<string> oov_words;
+		vector<int> word_wids;
 };
 
 #endif